@@ -44,7 +44,7 @@ void ask_for_options(Term::Terminal* term,
 
 	while (!set2) {
 		string answer = Term::prompt(*term,
-			"Page replacement mode(FIFO, LRU): ",
+			"Page replacement mode(FIFO, LRU, CLOCK, 2Q, ARC): ",
 			dummy, dummy2);
 		trim(answer);
 		if (answer == "FIFO") {
@@ -55,13 +55,55 @@ void ask_for_options(Term::Terminal* term,
 			mmalg = MM::Algorithm::LRU;
 			set2 = true;
 		}
+		else if (answer == "CLOCK") {
+			mmalg = MM::Algorithm::CLOCK;
+			set2 = true;
+		}
+		else if (answer == "2Q") {
+			mmalg = MM::Algorithm::TWO_Q;
+			set2 = true;
+		}
+		else if (answer == "ARC") {
+			mmalg = MM::Algorithm::ARC;
+			set2 = true;
+		}
 		else {
 			cout << answer << ": Unknown algorithm." << endl;
 		}
 	}
 }
 
-int main() {
+// --mkfs [-b block bytes] [-s data MB] [-i inodes], formats
+// disk.bin over whatever is there. -z pool KB compresses
+// swapped out pages in memory before they go to disk
+bool parse_args(int argc, char** argv, FS::MkfsOptions& opt, uint32_t& zswap) {
+	uint64_t mb = 0;
+	for (int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if (arg == "--mkfs") {
+			opt.force = true;
+			continue;
+		}
+		if (i + 1 == argc) return false;
+		uint64_t v = strtoull(argv[++i], nullptr, 10);
+		if (arg == "-b") opt.blk_size = static_cast<uint32_t>(v);
+		else if (arg == "-s") mb = v;
+		else if (arg == "-i") opt.ninodes = static_cast<uint32_t>((v + 63) / 64 * 64);
+		else if (arg == "-z") zswap = static_cast<uint32_t>(min<uint64_t>(v * 1024, UINT32_MAX));
+		else return false;
+	}
+	if (mb) opt.nblocks = static_cast<uint32_t>(min<uint64_t>(mb * 1024 * 1024 / opt.blk_size,
+		UINT32_MAX) / 64 * 64);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	FS::MkfsOptions mkfs;
+	uint32_t zswap = 0;
+	if (!parse_args(argc, argv, mkfs, zswap)) {
+		cout << "Usage: " << argv[0] << " [--mkfs] [-b block bytes] [-s data MB] [-i inodes] [-z zswap KB]" << endl;
+		return 1;
+	}
 	Term::Terminal* term = new Term::Terminal(true, true);
 	vector<string> dummy;
 	function<bool(string)> dummy2 = [](string) { return true; };
@@ -173,7 +215,7 @@ int main() {
 	}
 	cout << "Initializing...";
 	uint64_t uid = uname == "admin" ? 0 : hash<string>{}(uname);
-	Kernel* kernel = new Kernel(pralg, mmalg, uid);
+	Kernel* kernel = new Kernel(pralg, mmalg, uid, mkfs, zswap);
 	Shell_CLI shell(kernel, term, uname);
 	cout << "Done." << endl;
 	cout << Term::clear_screen() << Term::move_cursor(0, 0);
@@ -96,7 +96,7 @@ namespace Editor {
     void editorInsertNewline();
     void editorDelChar();
     char* editorRowsToString(int* buflen);
-    void editorOpen(char* filename, std::function<void(std::string, char*)> fn);
+    void editorOpen(char* filename, std::function<std::string(std::string)> fn);
     void editorSetStatusMessage(const char* fmt, ...);
     void editorSave(const Terminal& term, 
         std::function<void(std::string, char*, size_t)> fn);
@@ -112,10 +112,10 @@ namespace Editor {
         void (*callback)(char*, int));
     void editorMoveCursor(int key);
     bool editorProcessKeypress(const Terminal& term,
-        std::function<void(std::string, char*)> ofn,
+        std::function<std::string(std::string)> ofn,
         std::function<void(std::string, char*, size_t)> sfn);
     void initEditor(const Terminal& term);
     void editor(Terminal term, std::string file,
-        std::function<void(std::string, char*)> ofn,
+        std::function<std::string(std::string)> ofn,
         std::function<void(std::string, char*, size_t)> sfn);
 }
\ No newline at end of file
@@ -4,23 +4,34 @@
 /*
 0____1____2____3_________1027__________________
 |SBLK|D_BM|I_BM|Inodes...| data | .... | data |
+(defaults, the geometry is read from the superblock)
 
 Superblock occupies a single block,
 bitmaps each occupy a single block,
 each block contains 8 inodes, all 8192 inodes 
 occupy 1024 blocks. Each block can contain at most
-8 dir entries.
+8 dir entries. The metadata journal takes the last
+N_JOURNAL_BLKS blocks, after the data blocks.
+Disks formatted with larger blocks or more of them
+keep the same order, with as many bitmap blocks as
+the counts need, see Geometry.
 */
 
 namespace FS {
+	// smallest block size, directory, extent, index and journal
+	// tag blocks use only the first BLK_SIZE bytes of a block
 	constexpr uint32_t BLK_SIZE = 1024; // Bytes -> 1KB
-	constexpr uint32_t N_DATABLKS = BLK_SIZE * 8; // 8192 -> 8192*1KB=8MB
-	constexpr uint32_t N_INODES = BLK_SIZE * 8; // 8192 -> 8192*128B=1MB
+	constexpr uint32_t MAX_BLK_SIZE = 64 * 1024;
+	constexpr uint32_t N_DATABLKS = BLK_SIZE * 8; // 8192 -> 8192*1KB=8MB, mkfs default
+	constexpr uint32_t N_INODES = BLK_SIZE * 8; // 8192 -> 8192*128B=1MB, mkfs default
 	// disk amount = (3 + N_DATABLKS + N_INODES/(BLK_SIZE/INODE_SIZE)) * BLK_SIZE = 9MB + 1KB
-	constexpr uint32_t MAX_N_BLKS = 15; // max blocks for each file
+	constexpr uint32_t MAX_N_BLKS = 15; // max blocks for a direct mapped file
 	constexpr uint32_t MAX_NAME_LEN = 120; // max length for entry names
-	constexpr uint32_t N_INODEBLKS = N_INODES / (BLK_SIZE / 128);
+	constexpr uint32_t INODE_SIZE = 128; // on-disk inode slot
 	constexpr auto DEVICE = "disk.bin"; // the disk file
+	constexpr uint32_t N_CACHE_BLKS = 256; // buffer cache capacity, 256KB
+	constexpr uint32_t N_CACHE_INODES = 512; // inode cache capacity, 64KB
+	constexpr uint32_t N_CACHE_DENTRIES = 1024; // dentry cache capacity
 	constexpr uint32_t RD_OWNER = 1 << 5;
 	constexpr uint32_t WR_OWNER = 1 << 4;
 	constexpr uint32_t EX_OWNER = 1 << 3;
@@ -38,15 +49,69 @@ namespace FS {
 		Dir
 	};
 
-	struct Superblock { // 32B
+	constexpr uint32_t SB_BITMAP = 1; // imap/dmap hold one bit per object
+	constexpr uint32_t SB_LAZY_ITABLE = 2; // itable_init is kept
+
+	struct Superblock { // 40B, always at byte 0
 		uint32_t nblocks; // data blocks
 		uint32_t ninodes; // 
 		uint32_t nfreeblks; // 
 		uint32_t nfreeinodes; // 
-		uint32_t block_size; // 
+		uint32_t block_size; // 1K..64K, a power of two
 		uint32_t max_blocks; // size in blocks
 		uint32_t m_time; // last mount time
 		uint32_t w_time; // last write time
+		uint32_t flags; // SB_*, 0 on disks with byte maps
+		uint32_t itable_init; // inode table blocks zeroed so far
+	};
+
+	/*
+	Where everything is on the mounted disk, worked out from
+	the superblock's block_size, nblocks and ninodes. Each
+	bitmap takes as many blocks as its bits need, the inode
+	table keeps the sizing of 128B inodes, and the journal
+	is N_JOURNAL_BLKS kilobytes but at least MIN_JOURNAL_BLKS
+	blocks. A default 1KB disk comes out as drawn above.
+	*/
+	struct Geometry {
+		uint32_t blk_size;
+		uint32_t ndatablks;
+		uint32_t ninodes;
+		uint32_t dmap_start, dmap_blks;
+		uint32_t imap_start, imap_blks;
+		uint32_t itable_start, ninodeblks;
+		uint32_t data_start;
+		uint32_t journal_start, njournal;
+		uint32_t nblks; // the whole device
+	};
+
+	bool geometry(uint32_t blk_size, uint32_t nblocks, uint32_t ninodes, struct Geometry* g);
+	extern struct Geometry geo; // of the mounted disk
+
+	/*
+	Regular files map their data as extents, runs of
+	contiguous data blocks. The first N_INODE_EXTENTS live
+	in the inode over i_blockaddr, the rest in a chain of
+	ExtentBlocks. Inodes without EXT_MAGIC in i_flags, and
+	directories, use the direct i_blockaddr[] array.
+	*/
+	constexpr uint32_t EXT_MAGIC = 0x31545845; // "EXT1"
+	constexpr uint32_t N_INODE_EXTENTS = 7;
+
+	struct Extent { // 8B
+		uint32_t start; // first data block
+		uint32_t len; // blocks in the run, 0 ends the inline list
+	};
+
+	struct ExtentRoot { // 60B, same size as i_blockaddr
+		struct Extent e[N_INODE_EXTENTS];
+		uint32_t next; // first ExtentBlock, 0 if none (data block 0 is the root dir)
+	};
+
+	struct ExtentBlock { // 1KB
+		uint32_t count;
+		uint32_t next; // 0 ends the chain
+		struct Extent e[(BLK_SIZE - 8) / sizeof(struct Extent)];
 	};
 
 	struct Inode { // 128B
@@ -57,15 +122,18 @@ namespace FS {
 		uint32_t i_atime; // last access time
 		uint32_t i_ctime; // last change time (modify inode)
 		uint32_t i_mtime; // last modify time (modify data)
-		uint32_t i_blockaddr[MAX_N_BLKS]; // pointer to data blocks
+		union {
+			uint32_t i_blockaddr[MAX_N_BLKS]; // pointer to data blocks
+			struct ExtentRoot i_ext; // when i_flags == EXT_MAGIC
+		};
 		uint32_t i_acl; // permissions, rwxrwx
 		uint64_t i_uid; // owner
-		uint32_t fill1; // dummy
+		uint32_t i_flags; // EXT_MAGIC for extent mapped files
 		uint32_t fill2; // dummy
 		uint32_t fill3; // dummy
 		uint32_t fill4; // dummy
-		uint32_t fill5; // dummy
 	};
+	static_assert(sizeof(struct Inode) == INODE_SIZE, "struct Inode is copied as one table slot");
 
 	struct Dir { // 128B
 		uint32_t inode; // 
@@ -73,28 +141,489 @@ namespace FS {
 		uint16_t type; // File_t
 		char entry_name[MAX_NAME_LEN];
 		Dir() {
+			inode = 0;
 			next_entry = 0;
+			type = File_t::None;
 			memset(entry_name, 0, MAX_NAME_LEN);
 		}
 	};
 
+	/*
+	A directory starts as one block of 8 entries. When it
+	fills up, slots 2..7 of that block become the root of a
+	hash index (htree-style) over leaf blocks of 8 entries,
+	"." and ".." stay in slots 0 and 1. Index entries are
+	sorted by name hash, an entry covers hashes from its own
+	up to the next one. Once the root is full a second level
+	of index blocks is added below it.
+	*/
+	constexpr uint32_t DX_MAGIC = 0x68747265; // "htre"
+
+	struct DxEntry { // 8B
+		uint32_t hash; // lowest name hash in the block
+		uint32_t blk; // data block of the leaf or index node
+	};
+
+	struct DxRoot { // overlays dir slots 2..7, 768B
+		uint32_t magic; // DX_MAGIC
+		uint16_t count;
+		uint16_t unused; // where Dir::type sits, keeps slot 2 empty
+		uint16_t levels; // 1: entries point at leaves, 2: at DxNodes
+		uint16_t limit;
+		struct DxEntry entries[(6 * sizeof(struct Dir) - 12) / sizeof(struct DxEntry)];
+	};
+
+	struct DxNode { // 1KB
+		uint16_t count;
+		uint16_t limit;
+		uint32_t unused;
+		struct DxEntry entries[(BLK_SIZE - 8) / sizeof(struct DxEntry)];
+	};
+
+	uint32_t name_hash(const char* name);
+
+	struct DevStat {
+		uint64_t reads; // positioned reads issued
+		uint64_t writes; // positioned writes issued
+		uint64_t bytes_read;
+		uint64_t bytes_written;
+	};
+
+	enum class Backend {
+		Stream = 0, // pread/pwrite through the buffer cache
+		Mapped // whole image mapped into memory
+	};
+
+	/*
+	The disk image is opened once per mount, every
+	block/inode transfer is a positioned read or write
+	on that single handle instead of open/seek/close.
+	*/
+	class BlockDevice {
+	protected:
+		uint64_t disk_size;
+		mutex dev_lock; // the kernel thread and the aio worker share the handle
+	public:
+		DevStat counters;
+		BlockDevice();
+		virtual ~BlockDevice();
+		virtual bool good() = 0;
+		uint64_t capacity() { return disk_size; }
+		virtual bool read(char* buf, uint64_t pos, uint32_t size) = 0;
+		virtual bool write(const char* buf, uint64_t pos, uint32_t size) = 0;
+		// read-only pointer into the image, nullptr if the backend has none
+		virtual const char* view(uint64_t /*pos*/, uint32_t /*size*/) { return nullptr; }
+		virtual void sync() = 0;
+	};
+
+	class StreamDevice : public BlockDevice {
+	private:
+#ifdef _WIN32
+		fstream disk;
+#else
+		int fd;
+#endif
+	public:
+		StreamDevice(const char* path);
+		~StreamDevice();
+		bool good() override;
+		bool read(char* buf, uint64_t pos, uint32_t size) override;
+		bool write(const char* buf, uint64_t pos, uint32_t size) override;
+		void sync() override;
+	};
+
+#ifndef _WIN32
+	/*
+	Maps the whole image, block reads and writes are
+	memcpy in and out of the mapping, msync on sync().
+	*/
+	class MappedDevice : public BlockDevice {
+	private:
+		int fd;
+		char* base;
+	public:
+		MappedDevice(const char* path);
+		~MappedDevice();
+		bool good() override;
+		bool read(char* buf, uint64_t pos, uint32_t size) override;
+		bool write(const char* buf, uint64_t pos, uint32_t size) override;
+		const char* view(uint64_t pos, uint32_t size) override;
+		void sync() override;
+	};
+#endif
+
+	extern BlockDevice* dev; // mounted disk, opened by Filesystem
+
+	struct CacheStat {
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t writebacks; // dirty blocks written to device
+	};
+
+	struct ReadaheadStat {
+		uint64_t prefetched; // blocks read ahead of use
+		uint64_t hits; // prefetched blocks later read
+		uint64_t waste; // evicted or overwritten unread
+	};
+
+	struct BlockIO { // one whole block of a vectored transfer
+		uint32_t blk; // device block
+		char* buf; // geo.blk_size bytes
+	};
+
+	/*
+	Write-back buffer cache between the FS block layer and
+	the device. Fixed number of buffers keyed by block number,
+	LRU eviction, dirty buffers are written back when evicted
+	or on flush (unmount). With a journal, a dirty buffer may
+	only go home once a commit has logged it, unlogged ones
+	stay resident and the cache grows past capacity instead.
+	*/
+
+	class BufferCache {
+	private:
+		struct Buf {
+			uint32_t blk;
+			bool dirty;
+			bool logged; // contents are in a committed transaction
+			bool ra; // prefetched and not read yet
+			char* data;
+			char* frozen; // the committed image while data has newer changes
+		};
+		BlockDevice* disk;
+		size_t capacity;
+		size_t unlogged; // dirty buffers no commit has covered
+		list<struct Buf> lru; // front is the most recently used
+		unordered_map<uint32_t, list<struct Buf>::iterator> index;
+		unordered_set<uint32_t> ra_busy; // being prefetched outside cache_lock
+		unordered_set<uint32_t> ra_stale; // of those, written or freed meanwhile
+		mutex cache_lock;
+		struct Buf* get(uint32_t blk, bool fill);
+		struct Buf* alloc(uint32_t blk);
+		void writeback(struct Buf* b);
+	public:
+		CacheStat counters;
+		ReadaheadStat ra_counters;
+		BufferCache(BlockDevice* disk, size_t capacity);
+		~BufferCache();
+		bool read(char* buf, uint32_t blk, uint32_t offset, uint32_t size);
+		bool write(const char* buf, uint32_t blk, uint32_t offset, uint32_t size);
+		bool read_run(const struct BlockIO* io, size_t n);
+		bool write_run(const struct BlockIO* io, size_t n);
+		void prefetch(uint32_t blk, uint32_t n);
+		bool is_dirty(uint32_t blk);
+		void forget(uint32_t blk);
+		vector<struct BlockIO> pending();
+		void mark_logged();
+		size_t unlogged_count();
+		void flush(bool logged_only = false);
+	};
+
+	extern BufferCache* cache; // sits on top of dev
+
+	/*
+	Write-ahead metadata journal in the geo.njournal blocks
+	after the data blocks. Block 0 of the region holds the journal
+	header, transactions follow it back to back:
+	  descriptor, logged blocks, [descriptor, blocks, ...], commit
+	Each commit is one sequential write, the commit block
+	checksums everything before it so a torn write is simply
+	not replayed. Home locations are written lazily, by the
+	buffer cache, and the log restarts from the top once a
+	checkpoint has flushed every logged block. Freed blocks
+	are revoked so that older copies never overwrite data
+	written to them later.
+	*/
+	constexpr uint32_t N_JOURNAL_BLKS = 1024; // 1MB, with 1KB blocks
+	constexpr uint32_t MIN_JOURNAL_BLKS = 256;
+	constexpr uint32_t JNL_MAGIC = 0x314c4e4a; // "JNL1"
+	constexpr uint32_t JTAG_REVOKE = 1;
+
+	enum JBlock_t {
+		JHead = 1,
+		JDesc,
+		JCommit
+	};
+
+	struct JHeader { // 20B, starts every journal block
+		uint32_t magic;
+		uint32_t type; // JBlock_t
+		uint32_t seq; // transaction, for JHead the first one to replay
+		uint32_t count; // tags in a descriptor, blocks before a commit
+		uint32_t checksum; // commit only, FNV-1a of those blocks
+	};
+
+	struct JTag { // 8B
+		uint32_t blk; // home block
+		uint32_t flags; // JTAG_*, revokes have no logged block
+	};
+
+	constexpr uint32_t N_JTAGS = (BLK_SIZE - sizeof(struct JHeader)) / sizeof(struct JTag);
+
+	struct JournalStat {
+		uint64_t commits;
+		uint64_t logged; // blocks written to the log
+		uint64_t revokes;
+		uint64_t checkpoints;
+		uint64_t replayed; // blocks restored at mount
+	};
+
+	class Journal {
+	private:
+		BlockDevice* disk;
+		uint32_t seq; // next transaction
+		uint32_t head; // next free log block
+		unordered_set<uint32_t> in_log; // logged since the last checkpoint
+		unordered_set<uint32_t> revoked; // for the next commit
+		void write_head();
+	public:
+		JournalStat counters;
+		Journal(BlockDevice* disk);
+		bool recover();
+		void revoke(uint32_t blk);
+		bool commit(const vector<struct BlockIO>& blocks);
+		void checkpoint(const vector<struct BlockIO>* also = nullptr);
+	};
+
+	extern Journal* journal; // none until mounted
+
+	/*
+	Keeps hot inodes resident above the block layer.
+	write_inode only marks the cached copy dirty, dirty
+	inodes are written back one inode block at a time,
+	so several inodes changed in the same block cost a
+	single block write. Pinned inodes (refs > 0) are
+	never evicted.
+	*/
+	class InodeCache {
+	private:
+		struct Ent {
+			int index;
+			int refs;
+			bool dirty;
+			struct Inode inode;
+		};
+		size_t capacity;
+		list<struct Ent> lru; // front is the most recently used
+		unordered_map<int, list<struct Ent>::iterator> index;
+		mutex icache_lock;
+		struct Ent* get(int idx, bool fill);
+		void flush_block(uint32_t blk);
+	public:
+		CacheStat counters;
+		InodeCache(size_t capacity);
+		~InodeCache();
+		void read(struct Inode* inode, int idx);
+		void write(const struct Inode* inode, int idx);
+		void pin(int idx);
+		void unpin(int idx);
+		void flush();
+	};
+
+	extern InodeCache* icache;
+
+	struct LookupStat {
+		uint64_t hits;
+		uint64_t negative_hits; // names cached as absent
+		uint64_t misses; // directory block had to be scanned
+	};
+
+	/*
+	Maps (parent inode, name) to the child inode number so
+	a warm walk costs hash probes instead of directory block
+	scans. A child of -1 caches a name known to be absent.
+	create and fdelete update the entries they change.
+	*/
+	class DentryCache {
+	private:
+		typedef pair<int, string> Key;
+		struct KeyHash {
+			size_t operator()(const Key& k) const {
+				return hash<string>{}(k.second) ^ (hash<int>{}(k.first) * 31);
+			}
+		};
+		struct Ent {
+			Key key;
+			int child;
+		};
+		size_t capacity;
+		list<struct Ent> lru; // front is the most recently used
+		unordered_map<Key, list<struct Ent>::iterator, KeyHash> index;
+		mutex dcache_lock;
+	public:
+		LookupStat counters;
+		DentryCache(size_t capacity);
+		bool lookup(int parent, const string& name, int* child);
+		void insert(int parent, const string& name, int child);
+		void drop_dir(int parent);
+	};
+
+	extern DentryCache* dcache;
+
+	constexpr uint32_t AIO_MAX_XFER = 8 * BLK_SIZE; // per request, bounds the disk hold
+
+	struct AioStat {
+		uint64_t submitted;
+		uint64_t completed;
+		uint64_t reaped; // completions the kernel has taken
+		uint64_t bytes;
+		uint32_t depth; // queued and in flight now
+		uint32_t max_depth;
+		uint64_t lat_us; // host time from submit to completion, summed
+		uint64_t max_lat_us;
+		uint64_t lat_ticks; // kernel ticks from submit to reap, summed
+	};
+
+	struct AioReq {
+		int pid;
+		int fid;
+		int rw; // 1 read, 2 write, as in File, 3 flush held data
+		struct File* file; // outlives the request, entries are never freed
+		int inode; // the file a flush is for
+		string path;
+		uint32_t offset;
+		int size;
+		int result; // bytes moved, -1 on failure
+		uint32_t tick; // kernel clock at submit
+		chrono::steady_clock::time_point start;
+	};
+
+	/*
+	Moves file data off the kernel thread. One worker runs
+	requests in submission order, so a read queued behind a
+	write sees its data. The kernel reaps finished requests
+	once per tick and never waits for the disk.
+	*/
+	class AioEngine {
+	private:
+		function<int(struct AioReq&)> exec;
+		deque<struct AioReq> sq; // submitted
+		deque<struct AioReq> cq; // completed, not reaped yet
+		uint32_t inflight;
+		bool stop;
+		AioStat counters;
+		mutex aio_lock;
+		condition_variable aio_cv;
+		thread worker;
+		void run();
+	public:
+		AioEngine(function<int(struct AioReq&)> exec);
+		~AioEngine();
+		void submit(const struct AioReq& req);
+		bool reap(struct AioReq* req, uint32_t now);
+		void drain();
+		AioStat stat();
+	};
+
 	bool format_disk();
+	bool mount(Backend backend);
+	void unmount();
+	void sync();
 	bool write_block(char* buf, uint32_t blk, uint32_t offset, uint32_t size);
 	bool read_block(char* buf, uint32_t blk, uint32_t offset, uint32_t size);
+	// whole blocks, adjacent ones move in a single device transfer
+	bool write_blocks(const vector<struct BlockIO>& io);
+	bool read_blocks(const vector<struct BlockIO>& io);
+	const char* view_block(uint32_t blk);
 	bool write_inode(struct Inode* inode, int index);
 	bool read_inode(struct Inode* inode, int index);
 	bool set_bitmap(char* bitmap, int index, int val);
-	bool makefs();
-	bool init();
+
+	/*
+	Allocation map for inodes or data blocks, one bit per
+	object, scanned a 64-bit word at a time. Allocations
+	resume from the last one, and every change is mirrored
+	into the superblock free counter passed in.
+	*/
+	class Bitmap {
+	private:
+		vector<uint64_t> words; // whole blocks of the map
+		uint32_t nbits;
+		uint32_t* nfree;
+		uint32_t hint; // next search starts here
+		vector<bool> dirty; // blocks changed since take_dirty
+		uint32_t next_clear(uint32_t from, uint32_t to) const;
+		uint32_t next_set(uint32_t from, uint32_t to) const;
+		void mark(uint32_t start, uint32_t len);
+		void set_dirty(uint32_t start, uint32_t len);
+	public:
+		Bitmap(uint32_t nbits, uint32_t* nfree);
+		char* data();
+		uint32_t nblks() const; // blocks the map takes on disk
+		bool test(uint32_t i) const;
+		int alloc();
+		int alloc_run(uint32_t want, uint32_t goal, uint32_t* got);
+		void free(uint32_t start, uint32_t len = 1);
+		void reserve(uint32_t start, uint32_t len);
+		uint32_t count_free() const;
+		void load_bytes(const char* map, uint32_t size);
+		bool take_dirty(uint32_t blk); // and clear it
+	};
+	struct MkfsOptions {
+		uint32_t blk_size = BLK_SIZE;
+		uint32_t nblocks = N_DATABLKS; // data blocks
+		uint32_t ninodes = N_INODES;
+		bool force = false; // format over an existing image
+	};
+
+	bool makefs(const MkfsOptions& opt);
+	bool init(Backend backend, const MkfsOptions& opt = MkfsOptions());
 
 	void _perform_test();
 
+	/*
+	Delayed allocation. Data written to a file is held here,
+	by logical block, until the file is flushed: on its last
+	close, once it has been dirty for the dirty age, on sync,
+	or before it is read. Only then are data blocks allocated,
+	as contiguous runs, and written with one vectored write,
+	so repeated small appends to a block cost one transfer.
+	Close and age flushes run on the aio worker. The rest of
+	a partly written block is read in by the flush, a write
+	never touches the disk.
+	*/
+	constexpr uint32_t DA_DIRTY_AGE = 3; // default, in kernel ticks
+	constexpr uint32_t DA_MAX_BLKS = 1024; // held over all files before flushing early
+
+	struct HeldBlock {
+		char* data; // geo.blk_size bytes
+		vector<bool> written; // bytes set by writes, empty once all are known
+	};
+
+	struct DirtyFile {
+		uint64_t size; // i_size after the flush
+		uint32_t since; // tick of the first held write
+		uint32_t nres; // blocks past i_nblocks and their extent blocks, reserved from the free count
+		bool queued; // a flush request is on the aio queue
+		bool nospc; // the last flush found no space, the data is still held
+		map<uint32_t, struct HeldBlock> blks; // by logical block
+	};
+
+	/*
+	A swap file in use. Its slots are resolved to device byte
+	positions once, by swap_on, and the file cannot be removed
+	while it is on. Pages then move straight between memory and
+	the device, no walk, no inode update and no buffer cache.
+	*/
+	struct SwapArea {
+		int inode;
+		vector<uint64_t> slots; // slot -> byte position on the device
+	};
+
+	constexpr uint32_t RA_MIN_BLKS = 4; // first readahead window
+	constexpr uint32_t RA_MAX_BLKS = 32; // doubles up to this, 1/8 of the cache
+
 	struct File {
-		uint32_t offset;
+		uint32_t offset; // next append
 		string fname;
 		int counter;
 		int rw;
 		int inode;
+		// read side, owned by the aio worker
+		uint32_t rpos; // next read
+		uint32_t ra_next; // where a sequential read would start
+		uint32_t ra_win; // blocks, 0 after a random read
+		uint32_t ra_end; // first block not read ahead
 	};
 
 	struct QDesc {
@@ -108,19 +637,60 @@ class Filesystem {
 private:
 	uint64_t uid;
 	struct FS::Superblock* sb;
-	char* imap;
-	char* dmap;
+	FS::Bitmap* imap;
+	FS::Bitmap* dmap;
 	string pwd;
+	int pwd_index; // relative walks start here
 	struct FS::Inode* pwd_inode;
 	struct FS::Dir* c_dir;
 	void set_pwd_str(string path);
+	const struct FS::Dir* dir_block(uint32_t blk, struct FS::Dir* buf);
+	int lookup(int parent, uint32_t blk, const string& name, struct FS::Dir* buf);
+	int alloc_block();
+	void free_block(int db);
+	int dir_lookup(uint32_t blk, const string& name, struct FS::Dir* buf);
+	bool dir_add(struct FS::Inode* dinode, const string& name, int child, FS::File_t type);
+	bool dir_remove(struct FS::Inode* dinode, const string& name);
+	void dir_entries(const struct FS::Inode* dinode, vector<struct FS::Dir>& out);
+	int dir_free(struct FS::Inode* dinode);
+	void file_extents(const struct FS::Inode* inode, vector<struct FS::Extent>& out);
+	bool set_extents(struct FS::Inode* inode, const vector<struct FS::Extent>& ext);
+	bool file_extend(struct FS::Inode* inode, uint32_t nblks);
+	void file_free(struct FS::Inode* inode);
+	int32_t file_blk(const struct FS::Inode* inode, uint32_t lblk);
+	void itable_touch(int index);
+	void commit_if_full();
+	recursive_mutex file_lock;
 	function<void(int, void*)> idt;
 	vector<struct FS::File*> file_table;
 	vector<pair<list<int>, list<int>>> filequeue;
+	FS::AioEngine* aio;
+	map<int, int> io_busy; // inodes with a transfer running outside file_lock
+	condition_variable_any io_cv; // signalled as those finish
+	int aio_exec(struct FS::AioReq& req);
+	void io_done(int index);
+	void readahead(struct FS::File* f, const struct FS::Inode* inode, uint32_t offset, uint32_t size);
+	unordered_map<int, struct FS::DirtyFile> dirty_files; // by inode
+	uint32_t da_held; // blocks in dirty_files
+	uint32_t da_reserved; // free blocks promised to dirty_files
+	uint32_t da_age;
+	uint32_t da_clock; // kernel tick, sampled by commit()
+	map<int, uint64_t> da_busy; // flushes outside file_lock, the size they set
+	set<int> da_cut; // of those, files truncated or freed meanwhile
+	bool da_flush(int index);
+	void da_queue(int index);
+	void da_drop(int index);
+	void da_flush_all();
+	uint64_t da_size(int index, const struct FS::Inode* inode);
+	void frelease(int pid, int fid, int rw);
+	vector<struct FS::SwapArea> swap_areas;
+	mutex swap_lock; // guards swap_areas, swap_io never takes file_lock
 public:
-	Filesystem(function<void(int, void*)> idt, uint64_t uid);
+	Filesystem(function<void(int, void*)> idt, uint64_t uid,
+		FS::Backend backend = FS::Backend::Stream,
+		const FS::MkfsOptions& mkfs = FS::MkfsOptions());
 	~Filesystem();
-	int walk(string path, struct FS::Inode* inode, struct FS::Dir* dir);
+	int walk(const string& path, struct FS::Inode* inode, struct FS::Dir* dir);
 	int open(string path, int rw, int truncate);
 	void close(int fd);
 	bool create(string path, string name, FS::File_t type);
@@ -130,14 +700,28 @@ public:
 	int fread(int fid, int pid, int time);
 	int fwrite(int fid, int size, int pid, int time);
 	int exist(string path);
+	int64_t file_size(string path);
+	vector<struct FS::Dir> list_dir(string path);
 	string get_pwd();
 	void set_pwd(string path);
-	bool create_swapspace(string path, string name);
-	int write_swapspace(string path, char* buf, int blk);
-	int read_swapspace(string path, char* buf, int blk);
+	void sync();
+	void commit();
+	void set_dirty_age(uint32_t ticks);
+	FS::DevStat dev_stat();
+	FS::CacheStat cache_stat();
+	FS::CacheStat icache_stat();
+	FS::LookupStat dcache_stat();
+	FS::JournalStat journal_stat();
+	bool create_swapspace(string path, string name, uint32_t nslots = FS::MAX_N_BLKS);
 	void reset_swapspace(string path);
+	int swap_on(string path);
+	int swap_slots(int area);
+	int swap_io(int area, int slot, int n, char* buf, bool wr);
 	void chmod(string path, int mode);
 	void fpop(int pid, int fid, int rw, int size);
+	void aio_reap();
+	FS::AioStat aio_stat();
+	FS::ReadaheadStat ra_stat();
 	vector<pair<int, string>> expose_sft() {
 		vector<pair<int, string>> ff;
 		ff.resize(0);
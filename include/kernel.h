@@ -25,12 +25,15 @@ private:
 			}).base(), s.end());
 	}
 	uint64_t uid;
+	uint64_t acc_last; // MM::accesses at the last access_rate
+	chrono::steady_clock::time_point acc_when;
 
 public:
 	PageMemoryModel* pg;
 	Filesystem* fs;
 	Scheduler* sch;
-	Kernel(PR::Algorithm pa, MM::Algorithm ma, uint64_t uid);
+	Kernel(PR::Algorithm pa, MM::Algorithm ma, uint64_t uid,
+		const FS::MkfsOptions& mkfs = FS::MkfsOptions(), uint32_t zswap = 0);
 	~Kernel();
 	void int_handler(int int_type, void* args);
 	int load_prog(string path, VirtMemoryModel* mm, int* et, int* pri);
@@ -47,7 +50,9 @@ public:
 	vector<vector<string>> expose_pr();
 	vector<int> mem_map();
 	vector<int> swap_map();
+	bool mkswap(string path, string name, int nslots = FS::MAX_N_BLKS);
 	double statistic();
+	double access_rate();
 	void new_device(string name);
 	int del_device(string name);
 	vector<pair<string, vector<pair<int, int>>>> expose_devices();
@@ -26,6 +26,8 @@ namespace INTN {
 		REQ_UID,
 		FILE_DONE,
 		FILE_WAKE,
+		REQ_MEM_VIEW,
+		REQ_CLK_VIEW,
 	};
 }
 
@@ -6,13 +6,16 @@
 namespace MM {
 	constexpr uint32_t PHYS_MEM_SIZE = 1 << 14; // 16K
 	constexpr uint32_t PAGE_SIZE = 1 << 10; // 1K 
-	constexpr uint32_t VIRT_MEM_SIZE = 1 << 15; // 32K
+	constexpr uint64_t VIRT_MEM_SIZE = 1ull << 32; // 4G
+	constexpr uint32_t PROC_SPAN = 1 << 15; // 32K, what the programs touch
 	// npgs = 16
 	//constexpr uint32_t PHYS_MEM_KERNEL = 1 << 20; // 1MB
 	using phys_addr = uint32_t;
 	using virt_addr = uint32_t;
 	using log_addr = uint32_t;
 
+	extern atomic<uint64_t> accesses; // by every VirtMemoryModel::access, read by the GUI
+
 	struct VMA {
 		uint32_t start; // 4B
 		uint32_t end; // 4B
@@ -28,95 +31,177 @@ namespace MM {
 		struct VPage_desc* pgt_beg;
 	};
 
+	/*
+	FIFO and LRU scan the frame stamps for a victim, the others
+	keep their own order of the frames and find one in O(1)
+	amortized. CLOCK passes over pages referenced since its hand
+	last came by. 2Q takes new pages into a FIFO of a quarter of
+	the frames and remembers the ones it pushed out for half the
+	frames more, only those that fault back in from there join
+	the LRU main queue, so one scan over many pages can not flush
+	it. ARC shifts frames between a recency and a frequency LRU
+	by which of their remembered evicted pages fault again.
+	*/
 	enum class Algorithm {
 		LRU = 0,
 		FIFO,
-		NONE
+		NONE,
+		CLOCK, // after NONE, users in info.bin keep their values
+		TWO_Q,
+		ARC
 	};
 	enum class FreeStatus {
 		Success = 0,
 		Failed,
 		Writeback
 	};
+
+	/*
+	Swap-out copies the page into the swap cache and hands it
+	the next slot of the current cluster, so pages evicted one
+	after another sit next to each other. They are written once
+	SWAP_CLUSTER are pending, or at the end of the tick, each
+	run of adjacent slots in one transfer. A swap-in that misses
+	the cache reads the whole cluster around its slot and keeps
+	the pages of the same owner, the next faults of a process
+	tend to be its neighbouring pages.
+	*/
+	constexpr int SWAP_CLUSTER = 8; // slots
+	constexpr int SWAP_CACHE_PAGES = 32;
+
+	/*
+	With a zswap pool, swap-out first compresses the page into
+	it and the slot is only written once the pool runs full,
+	oldest pages first. Pages of one repeated byte are kept as
+	that byte, pages that do not shrink below ZSWAP_MAX_LEN go
+	to the swap area right away.
+	*/
+	constexpr uint32_t ZSWAP_MAX_LEN = PAGE_SIZE * 3 / 4;
+
+	/*
+	Per process, direct mapped by virtual page. An entry points
+	at the frame of a present page and is dropped when replace()
+	swaps that page out, a hit reads or writes the frame and the
+	kernel clock in place without any interrupt.
+	*/
+	constexpr int TLB_ENTRIES = 8;
+
+	/*
+	Page tables are radix trees over the virtual page number,
+	PT_BITS of it per level. Nodes are only allocated on the
+	path to a touched page, a process pays for its working set
+	and not for the 4G it could address.
+	*/
+	constexpr int VPN_BITS = 22; // 32 bit addresses, 1K pages
+	constexpr int PT_BITS = 6; // 64 entries a node
+	constexpr int PT_LEVELS = (VPN_BITS + PT_BITS - 1) / PT_BITS;
+
+	/*
+	Entries are packed flag bytes with the data in parallel
+	arrays, a 64 page leaf of a page table is one block and the
+	tables themselves are two vectors, copied in bulk on fork.
+	*/
+	constexpr uint8_t VP_PRESENT = 1 << 0;
+	constexpr uint8_t VP_RW = 1 << 1;
+	constexpr uint8_t VP_DIRTY = 1 << 2;
+	constexpr uint8_t VP_REFED = 1 << 3;
+	constexpr uint8_t PG_LOCKED = 1 << 0;
+	constexpr uint8_t PG_REFED = 1 << 1;
+	constexpr uint8_t PG_DIRTY = 1 << 2;
+
+	struct SwapStat {
+		uint64_t pages_out;
+		uint64_t pages_in;
+		uint64_t writes; // transfers
+		uint64_t reads;
+		uint64_t cache_hits; // swap-ins served without a read
+		uint64_t readaround; // pages brought in next to a faulting one
+		uint64_t z_stored; // pages taken by the zswap pool
+		uint64_t z_same; // of which one repeated byte
+		uint64_t z_rejected; // did not compress well enough
+		uint64_t z_spilled; // pushed out to the swap area
+		uint64_t z_hits; // swap-ins served from the pool
+		uint64_t z_raw; // bytes before and after compression
+		uint64_t z_packed;
+		uint32_t z_used; // pool bytes in use
+		uint32_t z_limit;
+	};
 }
 
-struct Page {
-	int locked;
-	int refed;
-	int dirty;
+struct TLB_entry {
+	int vpg; // -1 when empty
+	int pte; // its page table entry
+	int frame;
+	char* data; // the frame in physical memory
+};
+
+class PageTable {
+private:
+	struct Node {
+		uint32_t next[1 << MM::PT_BITS]; // node, on the last node level leaf + 1, 0 for none
+	};
+	struct Leaf {
+		uint8_t flags[1 << MM::PT_BITS]; // MM::VP_*
+		uint32_t addr[1 << MM::PT_BITS]; // physical page when present, else swap slot
+		uint16_t frame[1 << MM::PT_BITS]; // frame holding the page + 1, 0 for none
+	};
+	vector<Node> nodes; // nodes[0] is the root
+	vector<Leaf> leaves;
+
+public:
+	PageTable() : nodes(1) {}
+	int find(uint32_t vpg);
+	int get(uint32_t vpg);
+	uint8_t& flags(int pte) { return leaves[pte >> MM::PT_BITS].flags[pte & ((1 << MM::PT_BITS) - 1)]; }
+	uint32_t& addr(int pte) { return leaves[pte >> MM::PT_BITS].addr[pte & ((1 << MM::PT_BITS) - 1)]; }
+	uint16_t& frame(int pte) { return leaves[pte >> MM::PT_BITS].frame[pte & ((1 << MM::PT_BITS) - 1)]; }
+	void for_each(const function<void(int)>& f);
+	size_t bytes();
+};
+
+struct Swap_info { // one swap slot
+	int page; // physical page it was taken from, -1 when free
+	uint8_t flags; // of that page, kept for its return
 	int counter;
-	//atomic_int32_t mapcounter;
-	//struct list_head lru;
-	Page() {
-		locked = 0;
-		refed = 0;
-		dirty = 0;
-		counter = 0;
-	}
-	Page(struct Page* p) {
-		locked = p->locked;
-		refed = p->refed;
-		dirty = p->dirty;
-		counter = p->counter;
-	}
+	const void* owner; // address space the page belongs to
 };
 
-struct VPage {
-	int present;
-	int rw;
-	//int us;
-	int dirty;
-	int refed;
-	int t_in;
-	int t_ref;
-	uint32_t addr;
-	VPage() {
-		present = 0;
-		rw = 0;
-		//us = 0;
-		dirty = 0;
-		refed = 0;
-		addr = -1;
-		t_in = -1;
-		t_ref = -1;
-	}
-	VPage(struct VPage* v) {
-		present = v->present;
-		rw = v->rw;
-		//us = v->us;
-		dirty = v->dirty;
-		refed = v->refed;
-		addr = v->addr;
-		t_in = v->t_in;
-		t_ref = v->t_ref;
-	}
+struct Swap_cached {
+	char* data;
+	bool dirty; // not written to its slot yet
+	list<int>::iterator pos; // in the eviction order
 };
 
-struct Swap_info {
-	int page;
-	int blk;
-	struct Page* desc;
+struct Swap_zpage {
+	char* data; // compressed, nullptr for a same-filled page
+	uint32_t len;
+	char fill;
+	list<int>::iterator pos; // in the spill order
 };
 
 class PhysMemoryModel {
 private:
 	char* memory;
 	mutex mem_lock;
-	vector<string> swapspace = {"/.swap"};
+	vector<string> swapspace;
+	vector<int> swapdev; // filesystem swap area of each, see Filesystem::swap_on
 
 protected:
+	vector<int> swapbase; // first global slot of each swap area, ascending
 	int phys_mem_size;
 	virtual bool load(char* buf, MM::phys_addr from, uint32_t size) final;
 	virtual bool dump(char* buf, MM::phys_addr from, uint32_t size) final;
-	virtual int swap_out(MM::phys_addr from, function<void(int, void*)> idt, int blk) final;
-	virtual int swap_in(MM::phys_addr from, function<void(int, void*)> idt, int blk) final;
+	virtual int swap_rw(char* buf, int blk, int n, bool wr, function<void(int, void*)> idt) final;
 	
 public:
+	char* peek(MM::phys_addr from, uint32_t size);
 	vector<string> get_swaps() {
 		return swapspace;
 	}
-	void reg_swap(string path) {
+	void reg_swap(string path, int area, int base) {
 		swapspace.push_back(path);
+		swapdev.push_back(area);
+		swapbase.push_back(base);
 	}
 	PhysMemoryModel(int phys_mem_size);
 	~PhysMemoryModel();
@@ -127,11 +212,34 @@ private:
 	int pg_size;
 	int npgs;
 	function<void(int, void*)> idt;
-	list<struct Swap_info*> swaptable;
-	vector<int> swapbitmap;
+	vector<struct Swap_info> swaptable; // by global slot
+	vector<int> freeslots; // free slots, taken from the back, may hold used ones
+	vector<int> cluster_nfree; // free slots of each SWAP_CLUSTER
+	vector<int> free_clusters; // wholly free, may hold stale ones
+	vector<char> cluster_listed; // in free_clusters
+	int clu_next; // next slot of the current cluster
+	int clu_end;
+	unordered_map<int, struct Swap_cached> swapcache; // by slot
+	list<int> cache_order; // oldest first
+	vector<int> swap_pending; // dirty slots in swapcache
+	unordered_map<int, struct Swap_zpage> zpool; // by slot
+	list<int> zpool_order; // oldest first
+	uint32_t zpool_used;
+	uint32_t zpool_limit; // bytes, 0 when off
+	MM::SwapStat swapstat;
 	mutex pg_lock;
+	int alloc_slot();
+	void free_slot(int slot);
+	void cache_put(int slot, char* data, bool dirty);
+	void cache_drop(int slot);
+	void readaround(int slot, char* buf);
+	bool zpool_put(int slot, char* page);
+	bool zpool_get(int slot, char* page);
+	void zpool_drop(int slot);
+	void zpool_spill(uint32_t len);
 
-	vector<struct Page*> pgtable;
+	vector<uint8_t> pgflags; // MM::PG_*
+	vector<int> pgcount;
 	list<int> freepgs;
 
 public:
@@ -141,40 +249,75 @@ public:
 	int free_page(int pg);
 	void get(int pg, char* buf);
 	bool put(int pg, char* buf, int offset, int size);
-	bool pg_swap_out(int pg);
-	int pg_swap_in(int pg);
-	void release_swap(int pg);
+	char* frame_view(int pg);
+	int pg_swap_out(int pg, const void* owner);
+	int pg_swap_in(int slot);
+	void release_swap(int slot);
+	void swap_flush();
+	void set_zswap(uint32_t pool_bytes);
+	MM::SwapStat swap_stat();
 	void stat();
-	void new_swap(string path) {
-		reg_swap(path);
-		swapbitmap.resize(swapbitmap.size() + 15);
-	}
+	void new_swap(string path, int area, int nslots);
 	vector<int> expose_mem_map();
 	vector<int> expose_swap_map();
 };
 
 class VirtMemoryModel {
 private:
-	vector<struct VPage*> pgtable;
-	vector<int> frame;
+	PageTable pgtable;
+	vector<int> frame; // virtual page in each, -1 when empty
+	vector<int> frame_t_in; // when it came in
+	vector<int> frame_t_ref; // when it was last referenced
 	int nmapped;
 	int nblocks;
 	function<void(int, void*)> idt;
 	MM::Algorithm algo;
+	atomic<MM::Algorithm> algo_req; // from chalg on another thread, NONE once applied
 	int acc_cnt;
 	int repl_cnt;
+	struct TLB_entry tlb[MM::TLB_ENTRIES];
+	uint64_t tlb_hits;
+	uint64_t tlb_misses;
+	const uint32_t* clock; // the kernel's, from REQ_CLK_VIEW
+	vector<uint8_t> frame_ref; // referenced since the clock hand passed
+	int hand;
+	vector<int> fl_prev; // 2Q and ARC frame lists, see MM::Algorithm
+	vector<int> fl_next;
+	vector<int> fl_of; // list of each frame, -1 for none
+	int fl_head[2]; // most recent first
+	int fl_tail[2];
+	int fl_size[2];
+	list<int> ghost[2]; // pages evicted from the lists, most recent first
+	unordered_map<int, pair<int, list<int>::iterator>> ghost_pos;
+	int arc_p; // ARC's target size of list 0
+	struct TLB_entry* tlb_lookup(int pg);
+	struct TLB_entry* tlb_fill(int pg, int pte);
+	void tlb_flush(int pg);
+	int oldest(const vector<int>& stamp);
+	void fl_push(int l, int f);
+	void fl_remove(int f);
+	void ghost_push(int l, int pg);
+	void ghost_pop(int l);
+	int ghost_find(int pg);
+	void ghost_remove(int pg);
+	void touch(int f, int clk);
+	void admit(int f, int pg);
+	void evict(int f);
+	void policy_reset();
+	void policy_sync();
 
 public:
 	VirtMemoryModel(function<void(int, void*)> idt, MM::Algorithm algo);
 	VirtMemoryModel(VirtMemoryModel* v);
 	~VirtMemoryModel();
-	void replace();
-	int alloc_frame();
+	void replace(int pg);
+	int alloc_frame(int pg, int pte, int clk);
 	bool access_page(int pg, char* buf);
 	bool access(MM::virt_addr addr, char* buf);
 	bool view(MM::virt_addr from, MM::virt_addr to, char* buf);
 	int get_nmapped() { return nmapped; }
 	int get_nblocks() { return nblocks; }
+	size_t pt_bytes() { return pgtable.bytes(); }
 	void set_blocks(int blks);
 	bool write_page(int pg, char* buf, MM::log_addr addr, int size);
 	bool write(MM::virt_addr addr, char* buf, int size);
@@ -183,4 +326,5 @@ public:
 	vector<vector<string>> mm_expose(int pid, string name);
 	void chalg(MM::Algorithm newalg);
 	double pf_rate();
+	double tlb_rate();
 };
\ No newline at end of file
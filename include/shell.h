@@ -38,6 +38,7 @@ private:
 	string user;
 	bool exit;
 	int mode;
+	string read_file(string name);
 public:
 	Shell_CLI(Kernel* kernel, Term::Terminal* term, string uname);
 	~Shell_CLI();
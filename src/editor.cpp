@@ -380,15 +380,12 @@ namespace Editor {
         return buf;
     }
 
-    void editorOpen(char* filename, std::function<void(std::string, char*)> fn) {
+    void editorOpen(char* filename, std::function<std::string(std::string)> fn) {
         free(E.filename);
         E.filename = filename;
         editorSelectSyntaxHighlight();
-        char* buf = new char[15 * 1024];
-        fn(std::string(filename), buf);
-        std::string data(buf);
+        std::string data = fn(std::string(filename));
         std::string line;
-        delete buf;
         size_t pos = 0;
         while (pos != std::string::npos) {
             pos = data.find('\n');
@@ -743,7 +740,7 @@ namespace Editor {
     }
 
     bool editorProcessKeypress(const Terminal& term,
-        std::function<void(std::string, char*)> ofn,
+        std::function<std::string(std::string)> ofn,
         std::function<void(std::string, char*, size_t)> sfn) {
         static int quit_times = KILO_QUIT_TIMES;
 
@@ -853,7 +850,7 @@ namespace Editor {
     }
 
     void editor(Terminal term, std::string file,
-        std::function<void(std::string, char*)> ofn,
+        std::function<std::string(std::string)> ofn,
         std::function<void(std::string, char*, size_t)> sfn) {
         term.save_screen();
         initEditor(term);
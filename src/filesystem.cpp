@@ -1,125 +1,1272 @@
 #include "../include/filesystem.h"
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#include <filesystem>
 
 namespace FS {
-	bool format_disk() {
-		auto disk = fstream(DEVICE, ios::out | ios::trunc | ios::binary);
-		auto total_size = (3
-			+ N_INODEBLKS
-			+ N_DATABLKS)
-			* BLK_SIZE;
-		char* buf = new char[total_size];
-		if (disk.is_open() && buf) {
-			memset(buf, 0, total_size);
-			disk.write(buf, total_size);
-			delete[] buf;
-			disk.close();
+	BlockDevice* dev = nullptr;
+	struct Geometry geo;
+
+	BlockDevice::BlockDevice() {
+		memset(&counters, 0, sizeof(struct DevStat));
+		disk_size = 0;
+	}
+
+	BlockDevice::~BlockDevice() {}
+
+	StreamDevice::StreamDevice(const char* path) : BlockDevice() {
+#ifdef _WIN32
+		disk.open(path, ios::in | ios::out | ios::binary);
+		if (disk.is_open()) {
+			disk.seekg(0, ios::end);
+			disk_size = static_cast<uint64_t>(disk.tellg());
+		}
+#else
+		fd = ::open(path, O_RDWR);
+		if (fd >= 0) {
+			struct stat st;
+			if (fstat(fd, &st) == 0) disk_size = static_cast<uint64_t>(st.st_size);
+		}
+#endif
+	}
+
+	StreamDevice::~StreamDevice() {
+#ifdef _WIN32
+		if (disk.is_open()) disk.close();
+#else
+		if (fd >= 0) ::close(fd);
+#endif
+	}
+
+	bool StreamDevice::good() {
+#ifdef _WIN32
+		return disk.is_open();
+#else
+		return fd >= 0;
+#endif
+	}
+
+	bool StreamDevice::read(char* buf, uint64_t pos, uint32_t size) {
+		lock_guard<mutex> guard(dev_lock);
+		uint32_t done = 0;
+#ifdef _WIN32
+		disk.seekg(pos, ios::beg);
+		disk.read(buf, size);
+		done = static_cast<uint32_t>(disk.gcount());
+		disk.clear();
+#else
+		while (done < size) {
+			auto n = pread(fd, buf + done, size - done, pos + done);
+			if (n <= 0) break;
+			done += static_cast<uint32_t>(n);
+		}
+#endif
+		counters.reads++;
+		counters.bytes_read += done;
+		if (done < size) { // past the end of image
+			memset(buf + done, 0, size - done);
+			return false;
+		}
+		return true;
+	}
+
+	bool StreamDevice::write(const char* buf, uint64_t pos, uint32_t size) {
+		lock_guard<mutex> guard(dev_lock);
+		uint32_t done = 0;
+#ifdef _WIN32
+		disk.seekp(pos, ios::beg);
+		disk.write(buf, size);
+		if (disk) done = size;
+		disk.clear();
+#else
+		while (done < size) {
+			auto n = pwrite(fd, buf + done, size - done, pos + done);
+			if (n <= 0) break;
+			done += static_cast<uint32_t>(n);
+		}
+#endif
+		counters.writes++;
+		counters.bytes_written += done;
+		if (pos + done > disk_size) disk_size = pos + done;
+		return done == size;
+	}
+
+	void StreamDevice::sync() {
+		lock_guard<mutex> guard(dev_lock);
+#ifdef _WIN32
+		disk.flush();
+#else
+		fsync(fd);
+#endif
+	}
+
+#ifndef _WIN32
+	MappedDevice::MappedDevice(const char* path) : BlockDevice() {
+		base = nullptr;
+		fd = ::open(path, O_RDWR);
+		if (fd < 0) return;
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0) return;
+		void* p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (p == MAP_FAILED) return;
+		base = static_cast<char*>(p);
+		disk_size = static_cast<uint64_t>(st.st_size);
+	}
+
+	MappedDevice::~MappedDevice() {
+		if (base) {
+			msync(base, disk_size, MS_SYNC);
+			munmap(base, disk_size);
+		}
+		if (fd >= 0) ::close(fd);
+	}
+
+	bool MappedDevice::good() {
+		return base != nullptr;
+	}
+
+	bool MappedDevice::read(char* buf, uint64_t pos, uint32_t size) {
+		if (pos + size > disk_size) {
+			Log::w("(filesystem.cpp) MappedDevice::read: out of bound.\n");
+			return false;
+		}
+		lock_guard<mutex> guard(dev_lock);
+		memcpy(buf, base + pos, size);
+		counters.reads++;
+		counters.bytes_read += size;
+		return true;
+	}
+
+	bool MappedDevice::write(const char* buf, uint64_t pos, uint32_t size) {
+		if (pos + size > disk_size) {
+			Log::w("(filesystem.cpp) MappedDevice::write: out of bound.\n");
+			return false;
+		}
+		lock_guard<mutex> guard(dev_lock);
+		memcpy(base + pos, buf, size);
+		counters.writes++;
+		counters.bytes_written += size;
+		return true;
+	}
+
+	const char* MappedDevice::view(uint64_t pos, uint32_t size) {
+		if (pos + size > disk_size) return nullptr;
+		return base + pos;
+	}
+
+	void MappedDevice::sync() {
+		msync(base, disk_size, MS_SYNC);
+	}
+#endif
+
+	BufferCache* cache = nullptr;
+
+	// one device transfer for a run of adjacent blocks, through a
+	// bounce buffer unless the caller's buffers are back to back
+	static bool transfer_run(BlockDevice* disk, bool wr, const struct BlockIO* io, size_t n) {
+		bool flat = true;
+		for (size_t i = 1; i < n && flat; i++) flat = io[i].buf == io[0].buf + i * geo.blk_size;
+		uint64_t pos = static_cast<uint64_t>(io[0].blk) * geo.blk_size;
+		uint32_t size = static_cast<uint32_t>(n * geo.blk_size);
+		if (flat) return wr ? disk->write(io[0].buf, pos, size) : disk->read(io[0].buf, pos, size);
+		vector<char> bounce(size);
+		if (wr) for (size_t i = 0; i < n; i++) memcpy(&bounce[i * geo.blk_size], io[i].buf, geo.blk_size);
+		bool ok = wr ? disk->write(bounce.data(), pos, size) : disk->read(bounce.data(), pos, size);
+		if (!wr) for (size_t i = 0; i < n; i++) memcpy(io[i].buf, &bounce[i * geo.blk_size], geo.blk_size);
+		return ok;
+	}
+
+	BufferCache::BufferCache(BlockDevice* disk, size_t capacity)
+		: disk(disk), capacity(capacity), unlogged(0) {
+		memset(&counters, 0, sizeof(struct CacheStat));
+		memset(&ra_counters, 0, sizeof(struct ReadaheadStat));
+		index.reserve(capacity);
+	}
+
+	BufferCache::~BufferCache() {
+		flush();
+		for (auto& b : lru) {
+			delete[] b.data;
+			delete[] b.frozen;
+		}
+	}
+
+	void BufferCache::writeback(struct Buf* b) {
+		disk->write(b->data, static_cast<uint64_t>(b->blk) * geo.blk_size, geo.blk_size);
+		if (!b->logged) unlogged--;
+		b->dirty = false;
+		counters.writebacks++;
+	}
+
+	// look up blk, on a miss recycle the LRU buffer and read
+	// the block in unless the caller overwrites all of it
+	struct BufferCache::Buf* BufferCache::get(uint32_t blk, bool fill) {
+		auto v = index.find(blk);
+		if (v != index.end()) {
+			counters.hits++;
+			if (v->second->ra) {
+				ra_counters.hits++;
+				v->second->ra = false;
+			}
+			lru.splice(lru.begin(), lru, v->second);
+			return &lru.front();
+		}
+		counters.misses++;
+		struct Buf* b = alloc(blk);
+		if (fill) disk->read(b->data, static_cast<uint64_t>(blk) * geo.blk_size, geo.blk_size);
+		return b;
+	}
+
+	// an empty buffer for blk at the front, contents undefined
+	struct BufferCache::Buf* BufferCache::alloc(uint32_t blk) {
+		if (ra_busy.count(blk)) ra_stale.insert(blk); // the prefetched copy may be older
+		struct Buf b;
+		auto victim = lru.end();
+		if (lru.size() >= capacity) {
+			for (auto e = lru.rbegin(); e != lru.rend(); e++) {
+				if (!journal || !e->dirty || e->logged) {
+					victim = prev(e.base());
+					break;
+				}
+			}
+		}
+		if (victim != lru.end()) { // otherwise nothing may go home yet, grow
+			b = *victim;
+			if (b.dirty) writeback(&b);
+			if (b.ra) ra_counters.waste++;
+			index.erase(b.blk);
+			lru.erase(victim);
+		}
+		else {
+			b.data = new char[geo.blk_size];
+		}
+		b.blk = blk;
+		b.dirty = false;
+		b.logged = false;
+		b.ra = false;
+		b.frozen = nullptr;
+		lru.push_front(b);
+		index[blk] = lru.begin();
+		return &lru.front();
+	}
+
+	bool BufferCache::read(char* buf, uint32_t blk, uint32_t offset, uint32_t size) {
+		lock_guard<mutex> guard(cache_lock);
+		struct Buf* b = get(blk, true);
+		memcpy(buf, b->data + offset, size);
+		return true;
+	}
+
+	bool BufferCache::write(const char* buf, uint32_t blk, uint32_t offset, uint32_t size) {
+		lock_guard<mutex> guard(cache_lock);
+		struct Buf* b = get(blk, offset != 0 || size != geo.blk_size);
+		if (b->ra) { // overwritten before anyone read it
+			ra_counters.waste++;
+			b->ra = false;
+		}
+		if (b->dirty && b->logged) { // the checkpoint still owes the log this image
+			b->frozen = new char[geo.blk_size];
+			memcpy(b->frozen, b->data, geo.blk_size);
+		}
+		memcpy(b->data + offset, buf, size);
+		if (!b->dirty || b->logged) unlogged++;
+		b->dirty = true;
+		b->logged = false;
+		return true;
+	}
+
+	// cached blocks are copied out, each stretch of uncached ones
+	// is one device read that does not displace cached blocks.
+	// The reads run after cache_lock is dropped
+	bool BufferCache::read_run(const struct BlockIO* io, size_t n) {
+		vector<pair<size_t, size_t>> miss;
+		{
+			lock_guard<mutex> guard(cache_lock);
+			size_t i = 0;
+			while (i < n) {
+				auto v = index.find(io[i].blk);
+				if (v != index.end()) {
+					counters.hits++;
+					if (v->second->ra) {
+						ra_counters.hits++;
+						v->second->ra = false;
+					}
+					memcpy(io[i].buf, v->second->data, geo.blk_size);
+					lru.splice(lru.begin(), lru, v->second);
+					i++;
+					continue;
+				}
+				size_t j = i + 1;
+				while (j < n && index.find(io[j].blk) == index.end()) j++;
+				counters.misses += j - i;
+				miss.push_back({ i, j });
+				i = j;
+			}
+		}
+		bool ok = true;
+		for (auto& m : miss) ok = transfer_run(disk, false, io + m.first, m.second - m.first) && ok;
+		return ok;
+	}
+
+	// written through in one transfer, cached copies are refreshed
+	// and left clean since the device is about to match them
+	bool BufferCache::write_run(const struct BlockIO* io, size_t n) {
+		{
+			lock_guard<mutex> guard(cache_lock);
+			for (size_t i = 0; i < n; i++) {
+				if (ra_busy.count(io[i].blk)) ra_stale.insert(io[i].blk);
+				auto v = index.find(io[i].blk);
+				if (v == index.end()) continue;
+				if (v->second->ra) {
+					ra_counters.waste++;
+					v->second->ra = false;
+				}
+				memcpy(v->second->data, io[i].buf, geo.blk_size);
+				if (v->second->dirty && !v->second->logged) unlogged--;
+				v->second->dirty = false;
+				v->second->logged = false;
+				delete[] v->second->frozen;
+				v->second->frozen = nullptr;
+			}
+		}
+		return transfer_run(disk, true, io, n);
+	}
+
+	// read n blocks from blk into the cache ahead of use, cached
+	// ones are skipped and each missing stretch is one transfer.
+	// The reads go to private buffers outside cache_lock, a block
+	// cached meanwhile keeps the cached copy
+	void BufferCache::prefetch(uint32_t blk, uint32_t n) {
+		vector<pair<uint32_t, uint32_t>> miss; // first block, count
+		{
+			lock_guard<mutex> guard(cache_lock);
+			auto want = [&](uint32_t b) { return !index.count(b) && !ra_busy.count(b); };
+			uint32_t i = 0;
+			while (i < n) {
+				if (!want(blk + i)) {
+					i++;
+					continue;
+				}
+				uint32_t j = i + 1;
+				while (j < n && want(blk + j)) j++;
+				miss.push_back({ blk + i, j - i });
+				for (uint32_t k = i; k < j; k++) ra_busy.insert(blk + k);
+				i = j;
+			}
+		}
+		if (miss.empty()) return;
+		vector<vector<char>> data;
+		for (auto& m : miss) {
+			data.emplace_back(static_cast<size_t>(m.second) * geo.blk_size);
+			vector<struct BlockIO> io;
+			for (uint32_t k = 0; k < m.second; k++)
+				io.push_back({ m.first + k, &data.back()[static_cast<size_t>(k) * geo.blk_size] });
+			transfer_run(disk, false, io.data(), io.size());
+		}
+		lock_guard<mutex> guard(cache_lock);
+		for (size_t r = 0; r < miss.size(); r++) {
+			for (uint32_t k = 0; k < miss[r].second; k++) {
+				uint32_t at = miss[r].first + k;
+				ra_busy.erase(at);
+				if (ra_stale.erase(at) || index.count(at)) continue;
+				struct Buf* b = alloc(at);
+				memcpy(b->data, &data[r][static_cast<size_t>(k) * geo.blk_size], geo.blk_size);
+				b->ra = true;
+				ra_counters.prefetched++;
+			}
+		}
+	}
+
+	bool BufferCache::is_dirty(uint32_t blk) {
+		lock_guard<mutex> guard(cache_lock);
+		auto v = index.find(blk);
+		return v != index.end() && v->second->dirty;
+	}
+
+	// drop a freed block, pending changes to it are moot
+	void BufferCache::forget(uint32_t blk) {
+		lock_guard<mutex> guard(cache_lock);
+		if (ra_busy.count(blk)) ra_stale.insert(blk);
+		auto v = index.find(blk);
+		if (v == index.end()) return;
+		if (v->second->dirty && !v->second->logged) unlogged--;
+		if (v->second->ra) ra_counters.waste++;
+		delete[] v->second->data;
+		delete[] v->second->frozen;
+		lru.erase(v->second);
+		index.erase(v);
+	}
+
+	// dirty blocks no commit has covered yet, in block order
+	vector<struct BlockIO> BufferCache::pending() {
+		lock_guard<mutex> guard(cache_lock);
+		vector<struct BlockIO> out;
+		for (auto& b : lru) {
+			if (b.dirty && !b.logged) out.push_back({ b.blk, b.data });
+		}
+		sort(out.begin(), out.end(),
+			[](const struct BlockIO& a, const struct BlockIO& b) { return a.blk < b.blk; });
+		return out;
+	}
+
+	void BufferCache::mark_logged() {
+		lock_guard<mutex> guard(cache_lock);
+		for (auto& b : lru) {
+			if (!b.dirty) continue;
+			b.logged = true;
+			delete[] b.frozen; // the log has the newer image now
+			b.frozen = nullptr;
+		}
+		unlogged = 0;
+	}
+
+	size_t BufferCache::unlogged_count() {
+		lock_guard<mutex> guard(cache_lock);
+		return unlogged;
+	}
+
+	// write dirty blocks home. logged_only sends the committed
+	// image, a block changed since its commit stays dirty and
+	// its frozen copy goes home instead
+	void BufferCache::flush(bool logged_only) {
+		lock_guard<mutex> guard(cache_lock);
+		vector<struct Buf*> dirty;
+		for (auto& b : lru) {
+			if (b.dirty && (b.logged || b.frozen || !logged_only)) dirty.push_back(&b);
+		}
+		sort(dirty.begin(), dirty.end(),
+			[](struct Buf* a, struct Buf* b) { return a->blk < b->blk; });
+		for (auto b : dirty) {
+			if (logged_only && !b->logged) {
+				disk->write(b->frozen, static_cast<uint64_t>(b->blk) * geo.blk_size, geo.blk_size);
+				counters.writebacks++;
+			}
+			else writeback(b);
+			delete[] b->frozen;
+			b->frozen = nullptr;
+		}
+	}
+
+	Journal* journal = nullptr;
+
+	static uint32_t fnv1a(uint32_t h, const char* p, size_t n) {
+		for (size_t i = 0; i < n; i++) {
+			h ^= static_cast<unsigned char>(p[i]);
+			h *= 16777619u;
+		}
+		return h;
+	}
+
+	Journal::Journal(BlockDevice* disk) : disk(disk), seq(1), head(1) {
+		memset(&counters, 0, sizeof(struct JournalStat));
+	}
+
+	void Journal::write_head() {
+		vector<char> blk(geo.blk_size, 0);
+		struct JHeader* h = reinterpret_cast<struct JHeader*>(blk.data());
+		h->magic = JNL_MAGIC;
+		h->type = JHead;
+		h->seq = seq;
+		disk->write(blk.data(), static_cast<uint64_t>(geo.journal_start) * geo.blk_size, geo.blk_size);
+	}
+
+	// replay every complete transaction after the last checkpoint,
+	// then start an empty log
+	bool Journal::recover() {
+		vector<char> log(static_cast<size_t>(geo.njournal) * geo.blk_size);
+		disk->read(log.data(), static_cast<uint64_t>(geo.journal_start) * geo.blk_size,
+			static_cast<uint32_t>(log.size()));
+		auto hdr = [&](uint32_t i) {
+			return reinterpret_cast<const struct JHeader*>(&log[static_cast<size_t>(i) * geo.blk_size]);
+		};
+		if (hdr(0)->magic != JNL_MAGIC || hdr(0)->type != JHead) { // never used
+			write_head();
 			return true;
 		}
-		if (!disk) Log::w("(filesystem.cpp) format_disk: failed to open device.\n");
-		if (!buf) Log::w("(filesystem.cpp) format_disk: failed to allocate buffer.\n");
-		return false;
+		seq = hdr(0)->seq;
+		struct Txn {
+			uint32_t seq;
+			vector<pair<uint32_t, uint32_t>> blocks; // home, log position
+		};
+		vector<struct Txn> txns;
+		unordered_map<uint32_t, uint32_t> revoked_at; // home -> last revoking seq
+		uint32_t pos = 1;
+		while (pos < geo.njournal) {
+			uint32_t start = pos;
+			struct Txn t;
+			t.seq = seq;
+			vector<uint32_t> revokes;
+			bool done = false;
+			while (pos < geo.njournal && hdr(pos)->magic == JNL_MAGIC && hdr(pos)->seq == seq) {
+				if (hdr(pos)->type == JCommit) {
+					done = hdr(pos)->count == pos - start && hdr(pos)->checksum ==
+						fnv1a(2166136261u, &log[static_cast<size_t>(start) * geo.blk_size],
+							static_cast<size_t>(pos - start) * geo.blk_size);
+					pos++;
+					break;
+				}
+				if (hdr(pos)->type != JDesc || hdr(pos)->count > N_JTAGS) break;
+				const struct JTag* tags = reinterpret_cast<const struct JTag*>(hdr(pos) + 1);
+				uint32_t n = hdr(pos)->count;
+				uint32_t at = pos + 1;
+				for (uint32_t i = 0; i < n; i++) {
+					if (tags[i].flags & JTAG_REVOKE) revokes.push_back(tags[i].blk);
+					else t.blocks.push_back({ tags[i].blk, at++ });
+				}
+				pos = at;
+			}
+			if (!done) break; // torn or never written, the log ends here
+			for (auto b : revokes) revoked_at[b] = seq;
+			txns.push_back(t);
+			seq++;
+		}
+		for (auto& t : txns) {
+			for (auto& b : t.blocks) {
+				auto r = revoked_at.find(b.first);
+				if (r != revoked_at.end() && r->second >= t.seq) continue;
+				if (b.first >= geo.journal_start || b.second >= geo.njournal) continue;
+				disk->write(&log[static_cast<size_t>(b.second) * geo.blk_size],
+					static_cast<uint64_t>(b.first) * geo.blk_size, geo.blk_size);
+				counters.replayed++;
+			}
+		}
+		if (txns.size()) {
+			Log::i("(filesystem.cpp) Journal::recover: replayed %d transactions.\n",
+				static_cast<int>(txns.size()));
+			disk->sync();
+		}
+		write_head();
+		disk->sync();
+		head = 1;
+		return true;
 	}
 
-	bool write_block(char* buf, uint32_t blk, uint32_t offset, uint32_t size) {
-		if ((blk >= 3 + N_DATABLKS + N_INODEBLKS) || ((offset + size) > BLK_SIZE)) {
-			Log::w("(filesystem.cpp) write_block: out of bound.\n");
+	// only blocks logged since the last checkpoint can be replayed
+	// over a later use, nothing else needs a revoke record
+	void Journal::revoke(uint32_t blk) {
+		if (in_log.count(blk)) revoked.insert(blk);
+	}
+
+	// send every logged block home and restart the log. also
+	// holds blocks just committed that the cache does not know
+	// are logged yet
+	void Journal::checkpoint(const vector<struct BlockIO>* also) {
+		if (cache) cache->flush(true);
+		if (also) {
+			for (auto& b : *also)
+				disk->write(b.buf, static_cast<uint64_t>(b.blk) * geo.blk_size, geo.blk_size);
+		}
+		disk->sync();
+		write_head(); // seq is the next transaction, older ones are dead
+		disk->sync();
+		head = 1;
+		in_log.clear();
+		counters.checkpoints++;
+	}
+
+	// log blocks plus pending revokes as one transaction in a
+	// single sequential write
+	bool Journal::commit(const vector<struct BlockIO>& blocks) {
+		for (auto& b : blocks) revoked.erase(b.blk); // logged again, live again
+		if (blocks.empty() && revoked.empty()) return true;
+		vector<struct JTag> tags;
+		for (auto b : revoked) tags.push_back({ b, JTAG_REVOKE });
+		for (auto& b : blocks) tags.push_back({ b.blk, 0 });
+		uint32_t ndesc = static_cast<uint32_t>((tags.size() + N_JTAGS - 1) / N_JTAGS);
+		uint32_t total = ndesc + static_cast<uint32_t>(blocks.size()) + 1;
+		if (total > geo.njournal - 1) { // split, each part commits on its own
+			uint32_t room = geo.njournal - 2; // less the commit block
+			uint32_t ndesc_max = static_cast<uint32_t>((room + revoked.size() + N_JTAGS - 1) / N_JTAGS);
+			size_t m = room > ndesc_max ? room - ndesc_max : 1;
+			vector<struct BlockIO> part(blocks.begin(), blocks.begin() + m);
+			vector<struct BlockIO> rest(blocks.begin() + m, blocks.end());
+			Log::i("(filesystem.cpp) Journal::commit: transaction exceeds the log, split.\n");
+			if (!commit(part)) return false;
+			checkpoint(&part);
+			return commit(rest);
+		}
+		if (head + total > geo.njournal) checkpoint();
+
+		vector<char> txn(static_cast<size_t>(total) * geo.blk_size, 0);
+		size_t t = 0, nb = 0;
+		uint32_t at = 0;
+		while (t < tags.size()) {
+			struct JHeader* h = reinterpret_cast<struct JHeader*>(&txn[static_cast<size_t>(at++) * geo.blk_size]);
+			struct JTag* out = reinterpret_cast<struct JTag*>(h + 1);
+			h->magic = JNL_MAGIC;
+			h->type = JDesc;
+			h->seq = seq;
+			for (; t < tags.size() && h->count < N_JTAGS; t++) {
+				out[h->count++] = tags[t];
+				if (tags[t].flags & JTAG_REVOKE) continue;
+				memcpy(&txn[static_cast<size_t>(at++) * geo.blk_size], blocks[nb++].buf, geo.blk_size);
+			}
+		}
+		struct JHeader* c = reinterpret_cast<struct JHeader*>(&txn[static_cast<size_t>(at) * geo.blk_size]);
+		c->magic = JNL_MAGIC;
+		c->type = JCommit;
+		c->seq = seq;
+		c->count = at;
+		c->checksum = fnv1a(2166136261u, txn.data(), static_cast<size_t>(at) * geo.blk_size);
+		disk->write(txn.data(), static_cast<uint64_t>(geo.journal_start + head) * geo.blk_size,
+			static_cast<uint32_t>(txn.size()));
+
+		head += total;
+		seq++;
+		for (auto& b : blocks) in_log.insert(b.blk);
+		counters.commits++;
+		counters.logged += blocks.size();
+		counters.revokes += revoked.size();
+		revoked.clear();
+		return true;
+	}
+
+	InodeCache* icache = nullptr;
+
+	static uint32_t inodes_per_blk() {
+		return geo.blk_size / INODE_SIZE;
+	}
+
+	// inode idx lives in inode block idx / per block, device
+	// block itable_start + 1 + that
+	static uint32_t inode_blk(int idx) {
+		return geo.itable_start + idx / inodes_per_blk() + 1;
+	}
+
+	// device block of data block db
+	static uint32_t data_blk(uint32_t db) {
+		return geo.data_start + db;
+	}
+
+	InodeCache::InodeCache(size_t capacity) : capacity(capacity) {
+		memset(&counters, 0, sizeof(struct CacheStat));
+		index.reserve(capacity);
+	}
+
+	InodeCache::~InodeCache() {
+		flush();
+	}
+
+	// write back every dirty inode sharing the block, as one write
+	// of the whole block when all of its inodes are resident
+	void InodeCache::flush_block(uint32_t blk) {
+		int per_blk = inodes_per_blk();
+		int first = (blk - geo.itable_start - 1) * per_blk;
+		vector<struct Ent*> ents(per_blk);
+		int resident = 0;
+		for (int i = 0; i < per_blk; i++) {
+			auto v = index.find(first + i);
+			ents[i] = v == index.end() ? nullptr : &*v->second;
+			if (ents[i]) resident++;
+		}
+		vector<char> buf(geo.blk_size);
+		if (resident < per_blk) read_block(buf.data(), blk, 0, geo.blk_size);
+		for (int i = 0; i < per_blk; i++) {
+			if (!ents[i]) continue;
+			memcpy(&buf[i * INODE_SIZE], &ents[i]->inode, INODE_SIZE);
+			ents[i]->dirty = false;
+		}
+		write_block(buf.data(), blk, 0, geo.blk_size);
+		counters.writebacks++;
+	}
+
+	// look up idx, on a miss recycle the least recently used
+	// unpinned entry and read the inode in unless overwritten
+	struct InodeCache::Ent* InodeCache::get(int idx, bool fill) {
+		auto v = index.find(idx);
+		if (v != index.end()) {
+			counters.hits++;
+			lru.splice(lru.begin(), lru, v->second);
+			return &lru.front();
+		}
+		counters.misses++;
+		if (lru.size() >= capacity) {
+			auto victim = lru.end();
+			for (auto e = lru.rbegin(); e != lru.rend(); e++) {
+				if (!e->refs) {
+					victim = prev(e.base());
+					break;
+				}
+			}
+			if (victim != lru.end()) { // all pinned, let it grow
+				if (victim->dirty) flush_block(inode_blk(victim->index));
+				index.erase(victim->index);
+				lru.erase(victim);
+			}
+		}
+		struct Ent e;
+		e.index = idx;
+		e.refs = 0;
+		e.dirty = false;
+		if (fill) read_block(reinterpret_cast<char*>(&e.inode), inode_blk(idx),
+			(idx % inodes_per_blk()) * INODE_SIZE, INODE_SIZE);
+		lru.push_front(e);
+		index[idx] = lru.begin();
+		return &lru.front();
+	}
+
+	void InodeCache::read(struct Inode* inode, int idx) {
+		lock_guard<mutex> guard(icache_lock);
+		memcpy(inode, &get(idx, true)->inode, sizeof(struct Inode));
+	}
+
+	void InodeCache::write(const struct Inode* inode, int idx) {
+		lock_guard<mutex> guard(icache_lock);
+		struct Ent* e = get(idx, false);
+		memcpy(&e->inode, inode, sizeof(struct Inode));
+		e->dirty = true;
+	}
+
+	void InodeCache::pin(int idx) {
+		lock_guard<mutex> guard(icache_lock);
+		get(idx, true)->refs++;
+	}
+
+	void InodeCache::unpin(int idx) {
+		lock_guard<mutex> guard(icache_lock);
+		auto v = index.find(idx);
+		if (v != index.end() && v->second->refs) v->second->refs--;
+	}
+
+	void InodeCache::flush() {
+		lock_guard<mutex> guard(icache_lock);
+		set<uint32_t> blks;
+		for (auto& e : lru) {
+			if (e.dirty) blks.insert(inode_blk(e.index));
+		}
+		for (auto blk : blks) {
+			flush_block(blk);
+		}
+	}
+
+	DentryCache* dcache = nullptr;
+
+	DentryCache::DentryCache(size_t capacity) : capacity(capacity) {
+		memset(&counters, 0, sizeof(struct LookupStat));
+		index.reserve(capacity);
+	}
+
+	bool DentryCache::lookup(int parent, const string& name, int* child) {
+		lock_guard<mutex> guard(dcache_lock);
+		auto v = index.find({ parent, name });
+		if (v == index.end()) {
+			counters.misses++;
 			return false;
 		}
-		auto disk = fstream(DEVICE, ios::in | ios::out | ios::binary);
+		lru.splice(lru.begin(), lru, v->second);
+		*child = lru.front().child;
+		if (*child == -1) counters.negative_hits++;
+		else counters.hits++;
+		return true;
+	}
+
+	void DentryCache::insert(int parent, const string& name, int child) {
+		lock_guard<mutex> guard(dcache_lock);
+		Key k{ parent, name };
+		auto v = index.find(k);
+		if (v != index.end()) {
+			v->second->child = child;
+			lru.splice(lru.begin(), lru, v->second);
+			return;
+		}
+		if (lru.size() >= capacity) {
+			index.erase(lru.back().key);
+			lru.pop_back();
+		}
+		lru.push_front({ k, child });
+		index[k] = lru.begin();
+	}
+
+	// forget every name under a removed directory,
+	// its inode number may be handed out again
+	void DentryCache::drop_dir(int parent) {
+		lock_guard<mutex> guard(dcache_lock);
+		for (auto e = lru.begin(); e != lru.end(); ) {
+			if (e->key.first == parent) {
+				index.erase(e->key);
+				e = lru.erase(e);
+			}
+			else e++;
+		}
+	}
+
+	AioEngine::AioEngine(function<int(struct AioReq&)> exec)
+		: exec(exec), inflight(0), stop(false) {
+		memset(&counters, 0, sizeof(struct AioStat));
+		worker = thread(&AioEngine::run, this);
+	}
+
+	// finishes whatever was submitted before returning
+	AioEngine::~AioEngine() {
+		{
+			lock_guard<mutex> guard(aio_lock);
+			stop = true;
+		}
+		aio_cv.notify_all();
+		worker.join();
+	}
+
+	void AioEngine::run() {
+		unique_lock<mutex> guard(aio_lock);
+		while (true) {
+			aio_cv.wait(guard, [this] { return stop || sq.size(); });
+			if (!sq.size()) return; // stopping and drained
+			struct AioReq req = sq.front();
+			sq.pop_front();
+			inflight++;
+			guard.unlock();
+			req.result = exec(req);
+			uint64_t us = chrono::duration_cast<chrono::microseconds>(
+				chrono::steady_clock::now() - req.start).count();
+			guard.lock();
+			inflight--;
+			counters.completed++;
+			if (req.result > 0) counters.bytes += req.result;
+			counters.lat_us += us;
+			counters.max_lat_us = max(counters.max_lat_us, us);
+			cq.push_back(req);
+			aio_cv.notify_all(); // drain() may be waiting
+		}
+	}
+
+	void AioEngine::submit(const struct AioReq& req) {
+		{
+			lock_guard<mutex> guard(aio_lock);
+			sq.push_back(req);
+			sq.back().start = chrono::steady_clock::now();
+			counters.submitted++;
+			counters.max_depth = max<uint32_t>(counters.max_depth, sq.size() + inflight);
+		}
+		aio_cv.notify_all();
+	}
+
+	// never blocks on the worker, false when nothing finished
+	bool AioEngine::reap(struct AioReq* req, uint32_t now) {
+		lock_guard<mutex> guard(aio_lock);
+		if (!cq.size()) return false;
+		*req = cq.front();
+		cq.pop_front();
+		counters.reaped++;
+		counters.lat_ticks += now - req->tick;
+		return true;
+	}
+
+	// waits until every submitted request has run
+	void AioEngine::drain() {
+		unique_lock<mutex> guard(aio_lock);
+		aio_cv.wait(guard, [this] { return !sq.size() && !inflight; });
+	}
+
+	AioStat AioEngine::stat() {
+		lock_guard<mutex> guard(aio_lock);
+		AioStat s = counters;
+		s.depth = sq.size() + inflight;
+		return s;
+	}
+
+	bool mount(Backend backend) {
+		if (dev) return true;
+#ifndef _WIN32
+		if (backend == Backend::Mapped) dev = new MappedDevice(DEVICE);
+#else
+		if (backend == Backend::Mapped)
+			Log::w("(filesystem.cpp) mount: mapped backend unavailable, using stream.\n");
+#endif
+		if (!dev) dev = new StreamDevice(DEVICE);
+		if (!dev->good()) {
+			Log::w("(filesystem.cpp) mount: failed to open device.\n");
+			delete dev;
+			dev = nullptr;
+			return false;
+		}
+		journal = new Journal(dev);
+		journal->recover(); // before anything reads metadata
+		// also over a mapping, metadata has to wait for its commit
+		cache = new BufferCache(dev, N_CACHE_BLKS);
+		icache = new InodeCache(N_CACHE_INODES);
+		dcache = new DentryCache(N_CACHE_DENTRIES);
+		return true;
+	}
+
+	void unmount() {
+		if (!dev) return;
+		delete dcache;
+		dcache = nullptr;
+		delete icache; // writes back dirty inodes
+		icache = nullptr;
+		journal->commit(cache->pending()); // normally empty, Filesystem commits first
+		cache->mark_logged();
+		journal->checkpoint(); // leaves an empty log
+		delete cache; // writes back dirty blocks
+		cache = nullptr;
+		delete journal;
+		journal = nullptr;
+		dev->sync();
+		delete dev;
+		dev = nullptr;
+	}
+
+	void sync() {
+		if (icache) icache->flush();
+		if (journal && cache) {
+			journal->commit(cache->pending());
+			cache->mark_logged();
+			journal->checkpoint();
+		}
+		if (cache) cache->flush();
+		if (dev) dev->sync();
+	}
+
+	// lay out a disk, false if the parameters cannot describe one
+	bool geometry(uint32_t blk_size, uint32_t nblocks, uint32_t ninodes, struct Geometry* g) {
+		if (blk_size < BLK_SIZE || blk_size > MAX_BLK_SIZE || (blk_size & (blk_size - 1))) return false;
+		if (!nblocks || nblocks % 64 || !ninodes || ninodes % 64) return false; // whole map words
+		uint32_t bits = blk_size * 8;
+		g->blk_size = blk_size;
+		g->ndatablks = nblocks;
+		g->ninodes = ninodes;
+		g->dmap_start = 1;
+		g->dmap_blks = (nblocks + bits - 1) / bits;
+		g->imap_start = g->dmap_start + g->dmap_blks;
+		g->imap_blks = (ninodes + bits - 1) / bits;
+		g->itable_start = g->imap_start + g->imap_blks;
+		g->ninodeblks = ninodes / (blk_size / 128);
+		if (g->ninodeblks < 2) return false; // inode_blk() skips the first
+		g->data_start = g->itable_start + g->ninodeblks;
+		g->journal_start = g->data_start + nblocks;
+		g->njournal = max(N_JOURNAL_BLKS * BLK_SIZE / blk_size, MIN_JOURNAL_BLKS);
+		uint64_t total = static_cast<uint64_t>(g->journal_start) + g->njournal;
+		if (g->journal_start < nblocks || total > UINT32_MAX) return false;
+		g->nblks = static_cast<uint32_t>(total);
+		return true;
+	}
+
+	static uint64_t disk_bytes() {
+		return static_cast<uint64_t>(geo.nblks) * geo.blk_size;
+	}
+
+	// sized without writing, the holes read back as zeros,
+	// geo has to be set
+	bool format_disk() {
+		auto disk = fstream(DEVICE, ios::out | ios::trunc | ios::binary);
+		auto total_size = disk_bytes();
 		if (!disk.is_open()) {
-			Log::w("(filesystem.cpp) write_block: failed to open device.\n");
+			Log::w("(filesystem.cpp) format_disk: failed to open device.\n");
 			return false;
 		}
-		disk.seekp(blk * BLK_SIZE + offset, ios::beg);
-		disk.write(buf, size);
 		disk.close();
+		error_code ec;
+		std::filesystem::resize_file(DEVICE, total_size, ec);
+		if (ec) {
+			Log::w("(filesystem.cpp) format_disk: failed to size device.\n");
+			return false;
+		}
 		return true;
 	}
 
+	bool write_block(char* buf, uint32_t blk, uint32_t offset, uint32_t size) {
+		if ((blk >= geo.journal_start) || ((offset + size) > geo.blk_size)) {
+			Log::w("(filesystem.cpp) write_block: out of bound.\n");
+			return false;
+		}
+		if (!dev) {
+			Log::w("(filesystem.cpp) write_block: device not mounted.\n");
+			return false;
+		}
+		if (cache) return cache->write(buf, blk, offset, size);
+		return dev->write(buf, static_cast<uint64_t>(blk) * geo.blk_size + offset, size);
+	}
+
 	bool read_block(char* buf, uint32_t blk, uint32_t offset, uint32_t size) {
-		if ((blk >= 3 + N_DATABLKS + N_INODEBLKS) || ((offset + size) > BLK_SIZE)) {
+		if ((blk >= geo.journal_start) || ((offset + size) > geo.blk_size)) {
 			Log::w("(filesystem.cpp) read_block: out of bound.\n");
 			return false;
 		}
-		auto disk = fstream(DEVICE, ios::in | ios::binary);
-		if (!disk.is_open()) {
-			Log::w("(filesystem.cpp) read_block: failed to open device.\n");
+		if (!dev) {
+			Log::w("(filesystem.cpp) read_block: device not mounted.\n");
 			return false;
 		}
-		disk.seekg(blk * BLK_SIZE + offset, ios::beg);
-		disk.read(buf, size);
-		disk.close();
-		return true;
+		if (cache) return cache->read(buf, blk, offset, size);
+		return dev->read(buf, static_cast<uint64_t>(blk) * geo.blk_size + offset, size);
+	}
+
+	static bool blocks_io(bool wr, const vector<struct BlockIO>& io) {
+		if (!dev) {
+			Log::w(wr ? "(filesystem.cpp) write_blocks: device not mounted.\n"
+				: "(filesystem.cpp) read_blocks: device not mounted.\n");
+			return false;
+		}
+		vector<struct BlockIO> sorted(io);
+		stable_sort(sorted.begin(), sorted.end(),
+			[](const struct BlockIO& a, const struct BlockIO& b) { return a.blk < b.blk; });
+		if (sorted.size() && sorted.back().blk >= geo.journal_start) {
+			Log::w(wr ? "(filesystem.cpp) write_blocks: out of bound.\n"
+				: "(filesystem.cpp) read_blocks: out of bound.\n");
+			return false;
+		}
+		bool ok = true;
+		size_t i = 0;
+		while (i < sorted.size()) {
+			size_t j = i + 1;
+			while (j < sorted.size() && sorted[j].blk == sorted[j - 1].blk + 1) j++;
+			if (cache) ok = (wr ? cache->write_run(&sorted[i], j - i) : cache->read_run(&sorted[i], j - i)) && ok;
+			else ok = transfer_run(dev, wr, &sorted[i], j - i) && ok;
+			i = j;
+		}
+		return ok;
+	}
+
+	bool write_blocks(const vector<struct BlockIO>& io) {
+		return blocks_io(true, io);
+	}
+
+	bool read_blocks(const vector<struct BlockIO>& io) {
+		return blocks_io(false, io);
+	}
+
+	const char* view_block(uint32_t blk) {
+		if (!dev || blk >= geo.journal_start) return nullptr;
+		if (cache && cache->is_dirty(blk)) return nullptr; // image is stale
+		return dev->view(static_cast<uint64_t>(blk) * geo.blk_size, geo.blk_size);
 	}
 
 	bool write_inode(struct Inode* inode, int index) {
-		if (index < 0 || index >= N_INODES) {
+		if (index < 0 || static_cast<uint32_t>(index) >= geo.ninodes) {
 			Log::w("(filesystem.cpp) write_inode: out of bound.\n");
 			return false;
 		}
-		uint32_t blk = (uint32_t)floor(index / (BLK_SIZE / 128)) + 1;
-		uint32_t offset = index % (BLK_SIZE / 128);
-		return write_block(reinterpret_cast<char*>(inode), 3 + blk, offset * 128, 128);
+		if (icache) {
+			icache->write(inode, index);
+			return true;
+		}
+		uint32_t offset = index % inodes_per_blk();
+		return write_block(reinterpret_cast<char*>(inode), inode_blk(index), offset * INODE_SIZE, INODE_SIZE);
 	}
 
 	bool read_inode(struct Inode* inode, int index) {
-		if (index < 0 || index >= N_INODES) {
+		if (index < 0 || static_cast<uint32_t>(index) >= geo.ninodes) {
 			Log::w("(filesystem.cpp) read_inode: out of bound.\n");
 			return false;
 		}
-		uint32_t blk = (uint32_t)floor(index / (BLK_SIZE / 128)) + 1;
-		uint32_t offset = index % (BLK_SIZE / 128);
-		return read_block(reinterpret_cast<char*>(inode), 3 + blk, offset * 128, 128);
+		if (icache) {
+			icache->read(inode, index);
+			return true;
+		}
+		uint32_t offset = index % inodes_per_blk();
+		return read_block(reinterpret_cast<char*>(inode), inode_blk(index), offset * INODE_SIZE, INODE_SIZE);
+	}
+
+	uint32_t name_hash(const char* name) { // FNV-1a
+		uint32_t h = 2166136261u;
+		for (; *name; name++) {
+			h ^= static_cast<unsigned char>(*name);
+			h *= 16777619u;
+		}
+		return h;
 	}
 
 	bool set_bitmap(char* bitmap, int index, int val) {
-		if (index < 0 || index >= 8 * BLK_SIZE) {
+		if (index < 0 || static_cast<uint32_t>(index) >= 8 * geo.blk_size) {
 			Log::w("(filesystem.cpp) set_bitmap: out of bound.\n");
 			return false;
 		}
-		int p = (int)floor(index / 8);
-		int shift = (7 - index % 8);
-		if (val) bitmap[p] |= static_cast<char>(1) << shift;
-		else bitmap[p] &= ~(static_cast<char>(1) << shift);
+		int p = index / 8;
+		int shift = index % 8; // bit i of the map is bit i%64 of word i/64
+		if (val) bitmap[p] |= static_cast<char>(1 << shift);
+		else bitmap[p] &= static_cast<char>(~(1 << shift));
 		return true;
 	}
 
-	bool makefs() {
+	static inline uint32_t ctz64(uint64_t x) {
+#ifdef _MSC_VER
+		unsigned long i;
+		_BitScanForward64(&i, x);
+		return i;
+#else
+		return __builtin_ctzll(x);
+#endif
+	}
+
+	static inline uint32_t popcount64(uint64_t x) {
+#ifdef _MSC_VER
+		return static_cast<uint32_t>(__popcnt64(x));
+#else
+		return __builtin_popcountll(x);
+#endif
+	}
+
+	Bitmap::Bitmap(uint32_t nbits, uint32_t* nfree) : nbits(nbits), nfree(nfree), hint(0) {
+		words.assign(static_cast<size_t>(nblks()) * geo.blk_size / 8, 0);
+		dirty.assign(nblks(), true); // the first commit compares them all
+	}
+
+	char* Bitmap::data() {
+		return reinterpret_cast<char*>(words.data());
+	}
+
+	uint32_t Bitmap::nblks() const {
+		return (nbits + geo.blk_size * 8 - 1) / (geo.blk_size * 8);
+	}
+
+	bool Bitmap::test(uint32_t i) const {
+		return i < nbits && (words[i / 64] >> (i % 64) & 1);
+	}
+
+	// first free bit in [from, to), to if none
+	uint32_t Bitmap::next_clear(uint32_t from, uint32_t to) const {
+		if (from >= to) return to;
+		uint32_t w = from / 64;
+		uint64_t x = ~words[w] & (~0ull << (from % 64));
+		while (!x) {
+			if (++w * 64 >= to) return to;
+			x = ~words[w];
+		}
+		return min(w * 64 + ctz64(x), to);
+	}
+
+	// first used bit in [from, to), to if none
+	uint32_t Bitmap::next_set(uint32_t from, uint32_t to) const {
+		if (from >= to) return to;
+		uint32_t w = from / 64;
+		uint64_t x = words[w] & (~0ull << (from % 64));
+		while (!x) {
+			if (++w * 64 >= to) return to;
+			x = words[w];
+		}
+		return min(w * 64 + ctz64(x), to);
+	}
+
+	void Bitmap::mark(uint32_t start, uint32_t len) {
+		for (uint32_t i = start; i < start + len; i++) words[i / 64] |= 1ull << (i % 64);
+		*nfree -= len;
+		hint = start + len < nbits ? start + len : 0;
+		set_dirty(start, len);
+	}
+
+	void Bitmap::set_dirty(uint32_t start, uint32_t len) {
+		if (!len) return;
+		uint32_t per_blk = geo.blk_size * 8;
+		for (uint32_t b = start / per_blk; b <= (start + len - 1) / per_blk && b < dirty.size(); b++)
+			dirty[b] = true;
+	}
+
+	bool Bitmap::take_dirty(uint32_t blk) {
+		bool d = dirty[blk];
+		dirty[blk] = false;
+		return d;
+	}
+
+	// keep objects out of allocation, already used ones are skipped
+	void Bitmap::reserve(uint32_t start, uint32_t len) {
+		for (uint32_t i = start; i < start + len && i < nbits; i++) {
+			if (test(i)) continue;
+			words[i / 64] |= 1ull << (i % 64);
+			(*nfree)--;
+		}
+		set_dirty(start, len);
+	}
+
+	int Bitmap::alloc() {
+		uint32_t i = next_clear(hint, nbits);
+		if (i == nbits) i = next_clear(0, hint);
+		if (i >= nbits || test(i)) return -1; // wrapped back to hint
+		mark(i, 1);
+		return i;
+	}
+
+	// up to want bits in one run: the first long enough run
+	// from goal on, wrapping around, else the longest one
+	int Bitmap::alloc_run(uint32_t want, uint32_t goal, uint32_t* got) {
+		uint32_t best = 0, best_len = 0;
+		if (goal >= nbits) goal = 0;
+		for (int pass = 0; pass < 2 && best_len < want; pass++) {
+			uint32_t end = pass ? goal : nbits;
+			uint32_t i = next_clear(pass ? 0 : goal, end);
+			while (i < end) {
+				uint32_t len = next_set(i, min(nbits, i + want)) - i;
+				if (len > best_len) { best = i; best_len = len; }
+				if (len == want) break;
+				i = next_clear(i + len, end);
+			}
+		}
+		if (!best_len) return -1;
+		mark(best, best_len);
+		*got = best_len;
+		return best;
+	}
+
+	void Bitmap::free(uint32_t start, uint32_t len) {
+		for (uint32_t i = start; i < start + len && i < nbits; i++) {
+			if (!(words[i / 64] >> (i % 64) & 1)) {
+				Log::w("(filesystem.cpp) Bitmap::free: double free.\n");
+				continue;
+			}
+			words[i / 64] &= ~(1ull << (i % 64));
+			(*nfree)++;
+		}
+		set_dirty(start, len);
+	}
+
+	uint32_t Bitmap::count_free() const {
+		uint32_t used = 0;
+		for (uint32_t w = 0; w < nbits / 64; w++) used += popcount64(words[w]);
+		return nbits - used;
+	}
+
+	// maps written before SB_BITMAP, a nonzero byte per object
+	void Bitmap::load_bytes(const char* map, uint32_t size) {
+		fill(words.begin(), words.end(), 0);
+		for (uint32_t i = 0; i < size && i < nbits; i++)
+			if (map[i]) words[i / 64] |= 1ull << (i % 64);
+		dirty.assign(nblks(), true);
+	}
+
+	// geo already describes opt, see init()
+	bool makefs(const MkfsOptions& opt) {
 		// init superblock
 		time_t now = time(nullptr);
 		struct Superblock* sb = new struct Superblock;
 		if (sb) {
-			sb->nblocks = N_DATABLKS;
-			sb->ninodes = N_INODES;
-			sb->nfreeblks = N_DATABLKS;
-			sb->nfreeinodes = N_INODES;
-			sb->block_size = BLK_SIZE;
-			sb->max_blocks = 3
-				+ N_INODES / (BLK_SIZE / sizeof(struct Inode))
-				+ N_DATABLKS;
+			sb->nblocks = opt.nblocks;
+			sb->ninodes = opt.ninodes;
+			sb->nfreeblks = opt.nblocks;
+			sb->nfreeinodes = opt.ninodes;
+			sb->block_size = opt.blk_size;
+			sb->max_blocks = geo.nblks;
 			sb->m_time = (uint32_t)now;
 			sb->w_time = (uint32_t)now;
+			sb->flags = SB_BITMAP | SB_LAZY_ITABLE;
 		}
 		else {
 			Log::w("(filesystem.cpp) makefs: failed to allocate superblock.\n");
 			return false;
 		}
-		// init bitmaps
-		char* d_bitmap = new char[BLK_SIZE];
-		char* i_bitmap = new char[BLK_SIZE];
+		// init the first block of each bitmap, the rest is a hole
+		char* d_bitmap = new char[geo.blk_size];
+		char* i_bitmap = new char[geo.blk_size];
 		if (!(d_bitmap && i_bitmap)) {
 			Log::w("(filesystem.cpp) makefs: failed to allocate bitmap.\n");
 			return false;
 		}
-		memset(d_bitmap, 0, BLK_SIZE);
-		memset(i_bitmap, 0, BLK_SIZE);
-		// init inodes
-		struct Inode* inodes = new struct Inode[N_INODES];
+		memset(d_bitmap, 0, geo.blk_size);
+		memset(i_bitmap, 0, geo.blk_size);
+		// init the first two inode blocks, the second holds inode 0
+		// as inode_blk() counts, the rest is zeroed on first use
+		constexpr uint32_t eager = 2;
+		struct Inode* inodes = reinterpret_cast<struct Inode*>(new char[eager * geo.blk_size]);
 		if (!inodes) {
 			Log::w("(filesystem.cpp) makefs: failed to allocate inodes.\n");
 			return false;
 		}
-		memset(inodes, 0, N_INODES * sizeof(struct Inode));
+		memset(inodes, 0, eager * geo.blk_size);
+		sb->itable_init = eager;
 		// create /root
 		struct Inode* root = &inodes[0];
 		root->i_mode = File_t::Dir;
@@ -150,35 +1297,62 @@ namespace FS {
 		sb->nfreeinodes--;
 		// write back
 		write_block(reinterpret_cast<char*>(sb), 0, 0, sizeof(struct Superblock));
-		write_block(d_bitmap, 1, 0, BLK_SIZE);
-		write_block(i_bitmap, 2, 0, BLK_SIZE);
+		// init() reads the geometry before any journal replay
+		dev->write(reinterpret_cast<char*>(sb), 0, sizeof(struct Superblock));
+		write_block(d_bitmap, geo.dmap_start, 0, geo.blk_size);
+		write_block(i_bitmap, geo.imap_start, 0, geo.blk_size);
 		
 		//for (int i = 0; i < N_INODES; i++) { // too slow!!!
 		//	write_inode(&inodes[i], i);
 		//}
-		auto disk = fstream(DEVICE, ios::in | ios::out | ios::binary);
-		disk.seekp(3 * FS::BLK_SIZE, ios::beg);
-		disk.write(reinterpret_cast<char*>(inodes), sizeof(struct FS::Inode) * FS::N_INODES);
-		disk.close();
+		vector<struct BlockIO> table(eager);
+		for (uint32_t i = 0; i < eager; i++)
+			table[i] = { geo.itable_start + i, reinterpret_cast<char*>(inodes) + i * geo.blk_size };
+		write_blocks(table);
 
-		write_block(reinterpret_cast<char*>(root_dir), 3 + N_INODEBLKS, 0,
+		write_block(reinterpret_cast<char*>(root_dir), data_blk(0), 0,
 			sizeof(struct Dir) * 2);
 
 		delete sb;
 		delete[] d_bitmap; 
 		delete[] i_bitmap;
-		delete[] inodes;
+		delete[] reinterpret_cast<char*>(inodes);
 		delete[] root_dir;
 
 		return true;
 	}
 
-	bool init() {
+	// geometry of an existing image, from its superblock
+	static bool read_geometry() {
+		struct Superblock sb;
+		ifstream f(DEVICE, ios::binary);
+		if (!f.read(reinterpret_cast<char*>(&sb), sizeof(struct Superblock))) return false;
+		return geometry(sb.block_size, sb.nblocks, sb.ninodes, &geo);
+	}
+
+	// opt only matters when a disk is made
+	bool init(Backend backend, const MkfsOptions& opt) {
 		ifstream f(DEVICE);
-		if (!f.good()) {
+		bool fresh = !f.good() || opt.force;
+		f.close();
+		if (!fresh && !read_geometry()) {
+			Log::w("(filesystem.cpp) init: bad superblock, formatting.\n");
+			fresh = true;
+		}
+		if (fresh) {
+			if (!geometry(opt.blk_size, opt.nblocks, opt.ninodes, &geo)) {
+				Log::w("(filesystem.cpp) init: invalid disk geometry, using defaults.\n");
+				geometry(BLK_SIZE, N_DATABLKS, N_INODES, &geo);
+			}
 			format_disk();
-			makefs();
 		}
+		else { // images from before the journal end at the data blocks
+			error_code ec;
+			if (std::filesystem::file_size(DEVICE, ec) < disk_bytes() && !ec)
+				std::filesystem::resize_file(DEVICE, disk_bytes(), ec);
+		}
+		if (!mount(backend)) return false;
+		if (fresh) makefs(MkfsOptions{ geo.blk_size, geo.ndatablks, geo.ninodes });
 		return true;
 	}
 
@@ -198,14 +1372,14 @@ namespace FS {
 
 		char* bm = new char[BLK_SIZE];
 		
-		read_block(bm, 1, 0, BLK_SIZE);
+		read_block(bm, geo.dmap_start, 0, BLK_SIZE);
 		cout << "Data bitmap(first4):" << endl;
 		for (int j = 0; j < 4; j++) {
 			bitset<8> bits(bm[j]);
 			cout << bits << endl;
 		}
 		cout << endl;
-		read_block(bm, 2, 0, BLK_SIZE);
+		read_block(bm, geo.imap_start, 0, BLK_SIZE);
 		cout << "Inode bitmap(first4):" << endl;
 		for (int j = 0; j < 4; j++) {
 			bitset<8> bits(bm[j]);
@@ -225,7 +1399,7 @@ namespace FS {
 		cout << "    i_blockaddr[0]=" << root->i_blockaddr[0] << endl;
 		cout << "    i_acl=" << root->i_acl << endl;
 		struct Dir* dir = new struct Dir[8];
-		read_block(reinterpret_cast<char*>(dir), 3 + N_INODEBLKS + root->i_blockaddr[0], 0, BLK_SIZE);
+		read_block(reinterpret_cast<char*>(dir), data_blk(root->i_blockaddr[0]), 0, BLK_SIZE);
 		cout << "Root dir info:" << endl;
 		struct Dir* p = &dir[0];
 		while (1) {
@@ -239,116 +1413,665 @@ namespace FS {
 	}
 }
 
-Filesystem::Filesystem(function<void(int, void*)> idt, uint64_t uid) : idt(idt), uid(uid) {
-	//lock_guard<mutex> guard(file_lock);
-	FS::init();
-	sb = new struct FS::Superblock;
-	FS::read_block(reinterpret_cast<char*>(sb), 0, 0, sizeof(struct FS::Superblock));
-	imap = new char[FS::BLK_SIZE];
-	dmap = new char[FS::BLK_SIZE];
-	FS::read_block(dmap, 1, 0, FS::BLK_SIZE);
-	FS::read_block(imap, 2, 0, FS::BLK_SIZE);
-	pwd = "/";
-	pwd_inode = new struct FS::Inode;
-	c_dir = new struct FS::Dir[8];
-	FS::read_inode(pwd_inode, 0);
-	int blk = pwd_inode->i_blockaddr[0];
-	FS::read_block(reinterpret_cast<char*>(c_dir), 3 + FS::N_INODEBLKS + blk, 0, FS::BLK_SIZE);
-	file_table.resize(0);
-	filequeue.resize(0);
+// move a whole bitmap from or to its blocks starting at start
+static void map_io(FS::Bitmap* map, uint32_t start, bool wr) {
+	vector<struct FS::BlockIO> io(map->nblks());
+	for (uint32_t i = 0; i < map->nblks(); i++)
+		io[i] = { start + i, map->data() + static_cast<size_t>(i) * FS::geo.blk_size };
+	if (wr) FS::write_blocks(io);
+	else FS::read_blocks(io);
+}
+
+Filesystem::Filesystem(function<void(int, void*)> idt, uint64_t uid, FS::Backend backend,
+	const FS::MkfsOptions& mkfs)
+	: idt(idt), uid(uid) {
+	//lock_guard<mutex> guard(file_lock);
+	FS::init(backend, mkfs);
+	sb = new struct FS::Superblock;
+	FS::read_block(reinterpret_cast<char*>(sb), 0, 0, sizeof(struct FS::Superblock));
+	imap = new FS::Bitmap(FS::geo.ninodes, &sb->nfreeinodes);
+	dmap = new FS::Bitmap(FS::geo.ndatablks, &sb->nfreeblks);
+	map_io(dmap, FS::geo.dmap_start, false);
+	map_io(imap, FS::geo.imap_start, false);
+	if (!(sb->flags & FS::SB_BITMAP)) { // convert byte maps in place, 1KB disks only
+		char* bytes = new char[FS::BLK_SIZE];
+		memcpy(bytes, dmap->data(), FS::BLK_SIZE);
+		dmap->load_bytes(bytes, FS::BLK_SIZE);
+		memcpy(bytes, imap->data(), FS::BLK_SIZE);
+		imap->load_bytes(bytes, FS::BLK_SIZE);
+		delete[] bytes;
+		sb->flags |= FS::SB_BITMAP;
+	}
+	if (!(sb->flags & FS::SB_LAZY_ITABLE)) { // formatted whole
+		sb->itable_init = FS::geo.ninodeblks;
+		sb->flags |= FS::SB_LAZY_ITABLE;
+	}
+	// inode_blk() skips the first table block, inodes past the
+	// last full block would land on the data blocks
+	uint32_t usable = (FS::geo.ninodeblks - 1) * (FS::geo.blk_size / FS::INODE_SIZE);
+	imap->reserve(usable, FS::geo.ninodes - usable);
+	// the maps are the truth, counters may have drifted
+	sb->nfreeblks = dmap->count_free();
+	sb->nfreeinodes = imap->count_free();
+	pwd = "/";
+	pwd_index = 0;
+	pwd_inode = new struct FS::Inode;
+	c_dir = new struct FS::Dir[8];
+	if (FS::icache) FS::icache->pin(0); // root, every walk starts here
+	FS::read_inode(pwd_inode, 0);
+	int blk = pwd_inode->i_blockaddr[0];
+	FS::read_block(reinterpret_cast<char*>(c_dir), FS::data_blk(blk), 0, FS::BLK_SIZE);
+	file_table.resize(0);
+	filequeue.resize(0);
+	da_held = 0;
+	da_reserved = 0;
+	da_age = FS::DA_DIRTY_AGE;
+	da_clock = 0;
+	aio = new FS::AioEngine([this](struct FS::AioReq& req) { return aio_exec(req); });
+}
+
+Filesystem::~Filesystem() {
+	//lock_guard<mutex> guard(file_lock);
+	delete aio; // lets queued transfers finish first
+	{
+		lock_guard<recursive_mutex> guard(file_lock); // da_flush lets go of it
+		da_flush_all();
+	}
+	for (auto v : file_table) {
+		if (v) delete v;
+	}
+	FS::write_block(reinterpret_cast<char*>(sb), 0, 0, sizeof(struct FS::Superblock));
+	map_io(dmap, FS::geo.dmap_start, true);
+	map_io(imap, FS::geo.imap_start, true);
+	FS::unmount();
+	delete sb; delete pwd_inode;
+	delete[] c_dir;
+	delete imap; delete dmap;
+}
+
+void Filesystem::sync() {
+	aio->drain(); // the worker needs file_lock to finish
+	lock_guard<recursive_mutex> guard(file_lock);
+	da_flush_all();
+	FS::write_block(reinterpret_cast<char*>(sb), 0, 0, sizeof(struct FS::Superblock));
+	map_io(dmap, FS::geo.dmap_start, true);
+	map_io(imap, FS::geo.imap_start, true);
+	FS::sync();
+}
+
+// stage an in-memory metadata block only when it changed
+static void stage_block(char* buf, uint32_t blk, uint32_t size) {
+	vector<char> cur(size);
+	FS::read_block(cur.data(), blk, 0, size);
+	if (memcmp(cur.data(), buf, size)) FS::write_block(buf, blk, 0, size);
+}
+
+// group commit, everything changed since the last one goes
+// to the journal in one write, called once per kernel tick
+void Filesystem::commit() {
+	// the shell or the aio worker may be mid-update, the tick
+	// must not wait for it, whatever is staged goes next time
+	unique_lock<recursive_mutex> guard(file_lock, try_to_lock);
+	if (!guard.owns_lock()) return;
+	idt(INTN::INT::REQ_CLK, &da_clock);
+	for (auto& v : dirty_files) // written out on the aio worker
+		if (!v.second.queued && da_clock - v.second.since >= da_age) da_queue(v.first);
+	if (!FS::journal || !FS::cache) return;
+	stage_block(reinterpret_cast<char*>(sb), 0, sizeof(struct FS::Superblock));
+	for (uint32_t i = 0; i < dmap->nblks(); i++) // only the blocks a change touched
+		if (dmap->take_dirty(i)) stage_block(dmap->data() + static_cast<size_t>(i) * FS::geo.blk_size,
+			FS::geo.dmap_start + i, FS::geo.blk_size);
+	for (uint32_t i = 0; i < imap->nblks(); i++)
+		if (imap->take_dirty(i)) stage_block(imap->data() + static_cast<size_t>(i) * FS::geo.blk_size,
+			FS::geo.imap_start + i, FS::geo.blk_size);
+	if (FS::icache) FS::icache->flush();
+	FS::journal->commit(FS::cache->pending());
+	FS::cache->mark_logged();
+}
+
+// a burst within one tick must still fit in the log
+void Filesystem::commit_if_full() {
+	if (FS::cache && FS::cache->unlogged_count() > FS::geo.njournal / 4) commit();
+}
+
+FS::DevStat Filesystem::dev_stat() {
+	struct FS::DevStat ds;
+	memset(&ds, 0, sizeof(struct FS::DevStat));
+	if (FS::dev) ds = FS::dev->counters;
+	return ds;
+}
+
+FS::CacheStat Filesystem::cache_stat() {
+	struct FS::CacheStat cs;
+	memset(&cs, 0, sizeof(struct FS::CacheStat));
+	if (FS::cache) cs = FS::cache->counters;
+	return cs;
+}
+
+FS::CacheStat Filesystem::icache_stat() {
+	struct FS::CacheStat cs;
+	memset(&cs, 0, sizeof(struct FS::CacheStat));
+	if (FS::icache) cs = FS::icache->counters;
+	return cs;
+}
+
+FS::LookupStat Filesystem::dcache_stat() {
+	struct FS::LookupStat ls;
+	memset(&ls, 0, sizeof(struct FS::LookupStat));
+	if (FS::dcache) ls = FS::dcache->counters;
+	return ls;
+}
+
+FS::JournalStat Filesystem::journal_stat() {
+	struct FS::JournalStat js;
+	memset(&js, 0, sizeof(struct FS::JournalStat));
+	if (FS::journal) js = FS::journal->counters;
+	return js;
+}
+
+FS::AioStat Filesystem::aio_stat() {
+	return aio->stat();
+}
+
+FS::ReadaheadStat Filesystem::ra_stat() {
+	struct FS::ReadaheadStat rs;
+	memset(&rs, 0, sizeof(struct FS::ReadaheadStat));
+	if (FS::cache) rs = FS::cache->ra_counters;
+	return rs;
+}
+
+int Filesystem::walk(const string& path, struct FS::Inode* inode, struct FS::Dir* dir) {
+	//lock_guard<mutex> guard(file_lock);
+	//cout << "walk get: " << path << endl;
+	if (!path.size()) return -1; // should not happen
+	// absolute paths start at the root, relative ones at the cached pwd
+	int index = path[0] == '/' ? 0 : pwd_index;
+	FS::read_inode(inode, index);
+	uint32_t blk = FS::data_blk(inode->i_blockaddr[0]);
+	// directory blocks are only scanned on a dentry cache miss
+	char scratch[FS::BLK_SIZE];
+	struct FS::Dir* buf = dir ? dir : reinterpret_cast<struct FS::Dir*>(scratch);
+	size_t pos = 0;
+	while (pos < path.size()) {
+		if (path[pos] == '/') { // empty components, "//" or trailing '/'
+			pos++;
+			continue;
+		}
+		size_t end = path.find('/', pos);
+		if (end == string::npos) end = path.size();
+		size_t len = end - pos;
+		pos = end;
+		if (len == 1 && path[end - 1] == '.') continue; // .
+		if (inode->i_mode == FS::File_t::File) {
+			Log::w("(filesystem.cpp) walk: file not found 2.\n");
+			return -1;
+		}
+		// .. goes through the directory's own ".." entry
+		index = lookup(index, blk, path.substr(end - len, len), buf);
+		if(index == -1) {
+			Log::w("(filesystem.cpp) walk: file not found 1.\n");
+			return -1;
+		}
+		FS::read_inode(inode, index);
+		if (inode->i_mode != FS::File_t::File) {
+			blk = FS::data_blk(inode->i_blockaddr[0]);
+		}
+	}
+	// callers get the directory itself, or the one holding the file
+	if (dir) FS::read_block(reinterpret_cast<char*>(dir), blk, 0, FS::BLK_SIZE);
+	
+	return index;
+}
+
+// resolve one name in the directory at blk through the dentry
+// cache, reading directory blocks into buf only on a miss
+int Filesystem::lookup(int parent, uint32_t blk, const string& name, struct FS::Dir* buf) {
+	int child = -1;
+	if (FS::dcache && FS::dcache->lookup(parent, name, &child)) return child;
+	child = dir_lookup(blk, name, buf);
+	if (FS::dcache) FS::dcache->insert(parent, name, child);
+	return child;
+}
+
+int Filesystem::alloc_block() {
+	return dmap->alloc();
+}
+
+void Filesystem::free_block(int db) {
+	dmap->free(db);
+	if (FS::cache) FS::cache->forget(FS::data_blk(db));
+	if (FS::journal) FS::journal->revoke(FS::data_blk(db));
+}
+
+// the data block runs of a file in logical order, direct
+// mapped inodes give one run per block
+void Filesystem::file_extents(const struct FS::Inode* inode, vector<struct FS::Extent>& out) {
+	if (inode->i_flags != FS::EXT_MAGIC) {
+		for (uint32_t i = 0; i < inode->i_nblocks && i < FS::MAX_N_BLKS; i++)
+			out.push_back({ inode->i_blockaddr[i], 1 });
+		return;
+	}
+	for (uint32_t i = 0; i < FS::N_INODE_EXTENTS && inode->i_ext.e[i].len; i++)
+		out.push_back(inode->i_ext.e[i]);
+	struct FS::ExtentBlock eb;
+	for (uint32_t next = inode->i_ext.next; next; next = eb.next) {
+		FS::read_block(reinterpret_cast<char*>(&eb), FS::data_blk(next), 0, FS::BLK_SIZE);
+		for (uint32_t i = 0; i < eb.count; i++) out.push_back(eb.e[i]);
+	}
+}
+
+// store ext as the file's map, reusing the old ExtentBlock
+// chain and growing or trimming it to fit
+bool Filesystem::set_extents(struct FS::Inode* inode, const vector<struct FS::Extent>& ext) {
+	const uint32_t per_blk = sizeof(FS::ExtentBlock::e) / sizeof(struct FS::Extent);
+	vector<uint32_t> chain;
+	if (inode->i_flags == FS::EXT_MAGIC) {
+		struct FS::ExtentBlock eb;
+		for (uint32_t next = inode->i_ext.next; next; next = eb.next) {
+			chain.push_back(next);
+			FS::read_block(reinterpret_cast<char*>(&eb), FS::data_blk(next), 0, FS::BLK_SIZE);
+		}
+	}
+	size_t rest = ext.size() > FS::N_INODE_EXTENTS ? ext.size() - FS::N_INODE_EXTENTS : 0;
+	size_t need = (rest + per_blk - 1) / per_blk;
+	if (need > chain.size() && sb->nfreeblks < da_reserved + need - chain.size()) {
+		Log::w("(filesystem.cpp) set_extents: no space for extent blocks.\n");
+		return false;
+	}
+	while (chain.size() < need) chain.push_back(alloc_block());
+	while (chain.size() > need) {
+		free_block(chain.back());
+		chain.pop_back();
+	}
+
+	inode->i_flags = FS::EXT_MAGIC;
+	memset(&inode->i_ext, 0, sizeof(inode->i_ext));
+	size_t n = 0;
+	for (; n < ext.size() && n < FS::N_INODE_EXTENTS; n++) inode->i_ext.e[n] = ext[n];
+	inode->i_ext.next = chain.size() ? chain[0] : 0;
+	for (size_t c = 0; c < chain.size(); c++) {
+		struct FS::ExtentBlock eb;
+		memset(&eb, 0, sizeof(eb));
+		eb.next = c + 1 < chain.size() ? chain[c + 1] : 0;
+		for (; n < ext.size() && eb.count < per_blk; n++) eb.e[eb.count++] = ext[n];
+		FS::write_block(reinterpret_cast<char*>(&eb), FS::data_blk(chain[c]), 0, FS::BLK_SIZE);
+	}
+	return true;
+}
+
+// append nblks data blocks, as few runs as the free space
+// allows and growing the last extent when it can
+bool Filesystem::file_extend(struct FS::Inode* inode, uint32_t nblks) {
+	vector<struct FS::Extent> ext, taken;
+	file_extents(inode, ext);
+	uint32_t goal = ext.size() ? ext.back().start + ext.back().len : 0;
+	uint32_t added = 0;
+	while (added < nblks) {
+		uint32_t got = 0;
+		int start = dmap->alloc_run(nblks - added, goal, &got);
+		if (start == -1) break;
+		taken.push_back({ static_cast<uint32_t>(start), got });
+		if (ext.size() && ext.back().start + ext.back().len == static_cast<uint32_t>(start))
+			ext.back().len += got;
+		else
+			ext.push_back(taken.back());
+		added += got;
+		goal = start + got;
+	}
+	if (added < nblks || !set_extents(inode, ext)) {
+		for (auto& e : taken)
+			for (uint32_t i = 0; i < e.len; i++) free_block(e.start + i);
+		return false;
+	}
+	inode->i_nblocks += nblks;
+	return true;
+}
+
+// release every data block and extent block of a file
+void Filesystem::file_free(struct FS::Inode* inode) {
+	vector<struct FS::Extent> ext;
+	file_extents(inode, ext);
+	for (auto& e : ext)
+		for (uint32_t i = 0; i < e.len; i++) free_block(e.start + i);
+	if (inode->i_flags == FS::EXT_MAGIC) set_extents(inode, {});
+	inode->i_nblocks = 0;
+}
+
+// zero the inode table up to the block holding index, one
+// vectored write, before the inode is first handed out
+void Filesystem::itable_touch(int index) {
+	uint32_t tb = FS::inode_blk(index) - FS::geo.itable_start;
+	if (tb < sb->itable_init || tb >= FS::geo.ninodeblks) return;
+	uint32_t n = tb + 1 - sb->itable_init;
+	vector<char> zero(static_cast<size_t>(n) * FS::geo.blk_size, 0);
+	vector<struct FS::BlockIO> io(n);
+	for (uint32_t i = 0; i < n; i++)
+		io[i] = { FS::geo.itable_start + sb->itable_init + i,
+			&zero[static_cast<size_t>(i) * FS::geo.blk_size] };
+	FS::write_blocks(io);
+	sb->itable_init = tb + 1;
+}
+
+// data block of logical block lblk, -1 past the end
+int32_t Filesystem::file_blk(const struct FS::Inode* inode, uint32_t lblk) {
+	if (inode->i_flags != FS::EXT_MAGIC)
+		return lblk < inode->i_nblocks && lblk < FS::MAX_N_BLKS ? inode->i_blockaddr[lblk] : -1;
+	vector<struct FS::Extent> ext;
+	file_extents(inode, ext);
+	for (auto& e : ext) {
+		if (lblk < e.len) return e.start + lblk;
+		lblk -= e.len;
+	}
+	return -1;
 }
 
-Filesystem::~Filesystem() {
-	//lock_guard<mutex> guard(file_lock);
-	for (auto v : file_table) {
-		if (v) delete v;
-	}
-	FS::write_block(reinterpret_cast<char*>(sb), 0, 0, sizeof(struct FS::Superblock));
-	FS::write_block(dmap, 1, 0, FS::BLK_SIZE);
-	FS::write_block(imap, 2, 0, FS::BLK_SIZE);
-	delete sb; delete pwd_inode;
-	delete[] c_dir;
-	delete[] imap; delete[] dmap;
+static bool dx_indexed(const struct FS::Dir* root) {
+	return reinterpret_cast<const struct FS::DxRoot*>(root + 2)->magic == FS::DX_MAGIC;
 }
 
-int Filesystem::walk(string path, struct FS::Inode* inode, struct FS::Dir* dir) {
-	//lock_guard<mutex> guard(file_lock);
-	//cout << "walk get: " << path << endl;
-	if (!path.size()) return -1; // should not happen
-	if (path.size() > 1 && path[path.size() - 1] == '/')
-		path = path.substr(0, path.size() - 1); // normalize
-	int index = 0;
-	size_t pos = 0;
-	string name;
-	FS::read_inode(inode, index);
-	int blk = inode->i_blockaddr[0];
-	FS::read_block(reinterpret_cast<char*>(dir), 3 + FS::N_INODEBLKS + blk, 0, FS::BLK_SIZE);
-	if(path[0] == '.') {
-		if(path.size() == 1) { // .
-			path = pwd;
+// last entry whose hash is <= h, entries[0] always covers 0
+static int dx_find(const struct FS::DxEntry* entries, int count, uint32_t h) {
+	int lo = 0, hi = count - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (entries[mid].hash <= h) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+static void dx_insert(struct FS::DxEntry* entries, uint16_t* count, int pos, struct FS::DxEntry e) {
+	memmove(entries + pos + 1, entries + pos, (*count - pos) * sizeof(struct FS::DxEntry));
+	entries[pos] = e;
+	(*count)++;
+}
+
+// leaf block holding hash h below an index root
+static uint32_t dx_leaf(const struct FS::DxRoot* dx, uint32_t h) {
+	uint32_t db = dx->entries[dx_find(dx->entries, dx->count, h)].blk;
+	if (dx->levels == 2) {
+		struct FS::DxNode node;
+		FS::read_block(reinterpret_cast<char*>(&node), FS::data_blk(db), 0, FS::BLK_SIZE);
+		db = node.entries[dx_find(node.entries, node.count, h)].blk;
+	}
+	return db;
+}
+
+// the directory rooted at device block blk, views into the
+// mapping when there is one, otherwise copies into buf
+int Filesystem::dir_lookup(uint32_t blk, const string& name, struct FS::Dir* buf) {
+	const struct FS::Dir* entries = dir_block(blk, buf);
+	int n = 8;
+	if (dx_indexed(entries)) {
+		if (name == "." || name == "..") {
+			n = 2;
 		}
-		else if(path == "..") { // ..
-			path = pwd.substr(0, pwd.rfind("/"));
-			if (!path.size()) path = "/";
+		else {
+			uint32_t h = FS::name_hash(name.c_str());
+			auto dx = reinterpret_cast<const struct FS::DxRoot*>(entries + 2);
+			uint32_t db = dx->entries[dx_find(dx->entries, dx->count, h)].blk;
+			if (dx->levels == 2) {
+				auto node = reinterpret_cast<const struct FS::DxNode*>(
+					dir_block(FS::data_blk(db), buf));
+				db = node->entries[dx_find(node->entries, node->count, h)].blk;
+			}
+			entries = dir_block(FS::data_blk(db), buf);
 		}
-		else if(path[1] == '.' && path[2] == '/') { // ../xx
-			if(pwd == "/") path = path.substr(2);
-			else path = pwd.substr(0, pwd.rfind("/")) + path.substr(2);
+	}
+	for (int i = 0; i < n; i++) {
+		if (entries[i].type && name == entries[i].entry_name) {
+			return entries[i].inode;
 		}
-		else if(path[1] == '/') { // ./xx
-			if(pwd == "/") path = path.substr(1);
-			else path = pwd + path.substr(1);
+	}
+	return -1;
+}
+
+// add name to the directory, indexing it once the first block
+// is full and splitting leaves and index nodes as they fill,
+// the caller writes dinode back
+bool Filesystem::dir_add(struct FS::Inode* dinode, const string& name, int child, FS::File_t type) {
+	struct FS::Dir root[8];
+	uint32_t rblk = FS::data_blk(dinode->i_blockaddr[0]);
+	FS::read_block(reinterpret_cast<char*>(root), rblk, 0, FS::BLK_SIZE);
+	auto dx = reinterpret_cast<struct FS::DxRoot*>(root + 2);
+	if (!dx_indexed(root)) {
+		for (int i = 0; i < 8; i++) {
+			if (!root[i].type) {
+				strcpy(root[i].entry_name, name.c_str());
+				if (i > 0) {
+					if (i != 7) {
+						root[i].next_entry = root[i - 1].next_entry;
+					}
+					else {
+						root[i].next_entry = 0;
+					}
+					root[i - 1].next_entry = sizeof(struct FS::Dir);
+				}
+				else {
+					root[i].next_entry = sizeof(struct FS::Dir);
+				}
+				root[i].type = type;
+				root[i].inode = child;
+				FS::write_block(reinterpret_cast<char*>(root), rblk, 0, FS::BLK_SIZE);
+				return true;
+			}
 		}
-		else { // .a/xx, .../xx, etc.
-			// pass
+		// first block full, move its entries into a leaf and index it
+		int db = sb->nfreeblks > da_reserved ? alloc_block() : -1;
+		if (db == -1) {
+			Log::w("(filesystem.cpp) dir_add: not enough free data blocks.\n");
+			return false;
 		}
+		struct FS::Dir leaf[8]{};
+		for (int i = 2; i < 8; i++) leaf[i - 2] = root[i];
+		FS::write_block(reinterpret_cast<char*>(leaf), FS::data_blk(db), 0, FS::BLK_SIZE);
+		memset(dx, 0, sizeof(struct FS::DxRoot));
+		dx->magic = FS::DX_MAGIC;
+		dx->levels = 1;
+		dx->limit = sizeof(dx->entries) / sizeof(struct FS::DxEntry);
+		dx->count = 1;
+		dx->entries[0] = { 0, static_cast<uint32_t>(db) };
+		root[1].next_entry = 0;
+		FS::write_block(reinterpret_cast<char*>(root), rblk, 0, FS::BLK_SIZE);
+		dinode->i_nblocks++;
 	}
-	if(path == "/") {
-		return index;
+
+	uint32_t h = FS::name_hash(name.c_str());
+	int ri = dx_find(dx->entries, dx->count, h);
+	struct FS::DxNode node;
+	int ni = 0;
+	uint32_t leaf_db = dx->entries[ri].blk;
+	if (dx->levels == 2) {
+		FS::read_block(reinterpret_cast<char*>(&node), FS::data_blk(leaf_db), 0, FS::BLK_SIZE);
+		ni = dx_find(node.entries, node.count, h);
+		leaf_db = node.entries[ni].blk;
+	}
+	struct FS::Dir leaf[8];
+	FS::read_block(reinterpret_cast<char*>(leaf), FS::data_blk(leaf_db), 0, FS::BLK_SIZE);
+	int slot = 0;
+	for (; slot < 8 && leaf[slot].type; slot++);
+
+	if (slot == 8) { // split the leaf at a hash boundary
+		bool parent_full = dx->levels == 1 ?
+			dx->count == dx->limit : node.count == node.limit;
+		if (parent_full && dx->levels == 2 && dx->count == dx->limit) {
+			Log::w("(filesystem.cpp) dir_add: dir full.\n");
+			return false;
+		}
+		if (sb->nfreeblks < da_reserved + (parent_full ? 2u : 1u)) {
+			Log::w("(filesystem.cpp) dir_add: not enough free data blocks.\n");
+			return false;
+		}
+		pair<uint32_t, int> order[8];
+		for (int i = 0; i < 8; i++) order[i] = { FS::name_hash(leaf[i].entry_name), i };
+		sort(order, order + 8);
+		int mid = 4; // equal hashes must stay in one leaf
+		while (mid < 8 && order[mid].first == order[mid - 1].first) mid++;
+		if (mid == 8) {
+			mid = 4;
+			while (mid > 0 && order[mid].first == order[mid - 1].first) mid--;
+		}
+		if (mid == 0) {
+			Log::w("(filesystem.cpp) dir_add: hash collision, dir full.\n");
+			return false;
+		}
+		uint32_t split = order[mid].first;
+		struct FS::Dir lower[8]{}, upper[8]{};
+		for (int i = 0; i < 8; i++) {
+			if (i < mid) lower[i] = leaf[order[i].second];
+			else upper[i - mid] = leaf[order[i].second];
+		}
+		int new_db = alloc_block();
+		FS::write_block(reinterpret_cast<char*>(lower), FS::data_blk(leaf_db), 0, FS::BLK_SIZE);
+		FS::write_block(reinterpret_cast<char*>(upper), FS::data_blk(new_db), 0, FS::BLK_SIZE);
+		dinode->i_nblocks++;
+
+		struct FS::DxEntry e = { split, static_cast<uint32_t>(new_db) };
+		if (dx->levels == 1 && !parent_full) {
+			dx_insert(dx->entries, &dx->count, ri + 1, e);
+		}
+		else if (dx->levels == 1) { // root full, push its entries down a level
+			int ndb = alloc_block();
+			memset(&node, 0, sizeof(struct FS::DxNode));
+			node.limit = sizeof(node.entries) / sizeof(struct FS::DxEntry);
+			node.count = dx->count;
+			memcpy(node.entries, dx->entries, dx->count * sizeof(struct FS::DxEntry));
+			dx_insert(node.entries, &node.count, ri + 1, e);
+			FS::write_block(reinterpret_cast<char*>(&node), FS::data_blk(ndb), 0, FS::BLK_SIZE);
+			dx->levels = 2;
+			dx->count = 1;
+			dx->entries[0] = { 0, static_cast<uint32_t>(ndb) };
+			dinode->i_nblocks++;
+		}
+		else if (!parent_full) {
+			dx_insert(node.entries, &node.count, ni + 1, e);
+			FS::write_block(reinterpret_cast<char*>(&node), FS::data_blk(dx->entries[ri].blk),
+				0, FS::BLK_SIZE);
+		}
+		else { // index node full, its upper half goes under a new root entry
+			int ndb = alloc_block();
+			struct FS::DxNode up;
+			memset(&up, 0, sizeof(struct FS::DxNode));
+			int half = node.count / 2;
+			up.limit = node.limit;
+			up.count = node.count - half;
+			memcpy(up.entries, node.entries + half, up.count * sizeof(struct FS::DxEntry));
+			node.count = half;
+			if (ni + 1 >= half) dx_insert(up.entries, &up.count, ni + 1 - half, e);
+			else dx_insert(node.entries, &node.count, ni + 1, e);
+			FS::write_block(reinterpret_cast<char*>(&node), FS::data_blk(dx->entries[ri].blk),
+				0, FS::BLK_SIZE);
+			FS::write_block(reinterpret_cast<char*>(&up), FS::data_blk(ndb), 0, FS::BLK_SIZE);
+			dx_insert(dx->entries, &dx->count, ri + 1,
+				{ up.entries[0].hash, static_cast<uint32_t>(ndb) });
+			dinode->i_nblocks++;
+		}
+		FS::write_block(reinterpret_cast<char*>(root), rblk, 0, FS::BLK_SIZE);
+
+		if (h >= split) {
+			memcpy(leaf, upper, sizeof(leaf));
+			leaf_db = new_db;
+		}
+		else {
+			memcpy(leaf, lower, sizeof(leaf));
+		}
+		for (slot = 0; leaf[slot].type; slot++);
 	}
-	else if (path[0] != '/') {
-		if(pwd[pwd.size() - 1] == '/')
-			path = pwd + path;
-		else
-			path = pwd + "/" + path;
-	}
-	path = path.substr(1);
-	while (1) {
-		pos = path.find('/');
-		name = path.substr(0, pos);
-		path = pos == string::npos ? "" : path.substr(pos + 1);
-		int i = 0;
-		for ( ; i < 8; i++) {
-			if(dir[i].type) {
-				if (name == dir[i].entry_name) {
-					index = dir[i].inode;
-					break;
-				}
-			}
+	leaf[slot] = {};
+	strcpy(leaf[slot].entry_name, name.c_str());
+	leaf[slot].type = type;
+	leaf[slot].inode = child;
+	FS::write_block(reinterpret_cast<char*>(leaf), FS::data_blk(leaf_db), 0, FS::BLK_SIZE);
+	return true;
+}
+
+bool Filesystem::dir_remove(struct FS::Inode* dinode, const string& name) {
+	struct FS::Dir entries[8];
+	uint32_t blk = FS::data_blk(dinode->i_blockaddr[0]);
+	FS::read_block(reinterpret_cast<char*>(entries), blk, 0, FS::BLK_SIZE);
+	if (dx_indexed(entries)) {
+		auto dx = reinterpret_cast<const struct FS::DxRoot*>(entries + 2);
+		blk = FS::data_blk(dx_leaf(dx, FS::name_hash(name.c_str())));
+		FS::read_block(reinterpret_cast<char*>(entries), blk, 0, FS::BLK_SIZE);
+	}
+	for (int i = 0; i < 8; i++) {
+		if (entries[i].type && name == entries[i].entry_name) {
+			entries[i].type = FS::File_t::None;
+			FS::write_block(reinterpret_cast<char*>(entries), blk, 0, FS::BLK_SIZE);
+			return true;
 		}
-		//cout << "here" << endl;
-		if(i == 8) {
-			Log::w("(filesystem.cpp) walk: file not found 1.\n");
-			return -1;
+	}
+	return false;
+}
+
+void Filesystem::dir_entries(const struct FS::Inode* dinode, vector<struct FS::Dir>& out) {
+	struct FS::Dir entries[8];
+	FS::read_block(reinterpret_cast<char*>(entries), FS::data_blk(dinode->i_blockaddr[0]),
+		0, FS::BLK_SIZE);
+	if (!dx_indexed(entries)) {
+		for (int i = 0; i < 8; i++) {
+			if (entries[i].type) out.push_back(entries[i]);
 		}
-		//cout << "where" << endl;
-		FS::read_inode(inode, index);
-		if (inode->i_mode == FS::File_t::Dir) {
-			int blk = inode->i_blockaddr[0];
-			FS::read_block(reinterpret_cast<char*>(dir), 3 + FS::N_INODEBLKS + blk, 0, FS::BLK_SIZE);
+		return;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (entries[i].type) out.push_back(entries[i]);
+	}
+	struct FS::DxRoot dx = *reinterpret_cast<const struct FS::DxRoot*>(entries + 2);
+	vector<uint32_t> leaves;
+	for (int i = 0; i < dx.count; i++) {
+		if (dx.levels == 1) {
+			leaves.push_back(dx.entries[i].blk);
+			continue;
 		}
-		else if (path.size() && (inode->i_mode == FS::File_t::File)) {
-			Log::w("(filesystem.cpp) walk: file not found 2.\n");
-			delete inode;
-			delete[] dir;
-			return -1;
+		struct FS::DxNode node;
+		FS::read_block(reinterpret_cast<char*>(&node), FS::data_blk(dx.entries[i].blk),
+			0, FS::BLK_SIZE);
+		for (int j = 0; j < node.count; j++) leaves.push_back(node.entries[j].blk);
+	}
+	for (auto db : leaves) {
+		FS::read_block(reinterpret_cast<char*>(entries), FS::data_blk(db), 0, FS::BLK_SIZE);
+		for (int i = 0; i < 8; i++) {
+			if (entries[i].type) out.push_back(entries[i]);
 		}
-		if (!path.size()) {
-			break;
+	}
+}
+
+// release every block of a directory, leaves and index nodes
+// included, returns how many were freed
+int Filesystem::dir_free(struct FS::Inode* dinode) {
+	struct FS::Dir entries[8];
+	FS::read_block(reinterpret_cast<char*>(entries), FS::data_blk(dinode->i_blockaddr[0]),
+		0, FS::BLK_SIZE);
+	int n = 0;
+	if (dx_indexed(entries)) {
+		struct FS::DxRoot dx = *reinterpret_cast<const struct FS::DxRoot*>(entries + 2);
+		for (int i = 0; i < dx.count; i++) {
+			if (dx.levels == 2) {
+				struct FS::DxNode node;
+				FS::read_block(reinterpret_cast<char*>(&node), FS::data_blk(dx.entries[i].blk),
+					0, FS::BLK_SIZE);
+				for (int j = 0; j < node.count; j++, n++) free_block(node.entries[j].blk);
+			}
+			free_block(dx.entries[i].blk);
+			n++;
 		}
+		free_block(dinode->i_blockaddr[0]);
+		return n + 1;
 	}
-	
-	return index;
+	for (uint32_t i = 0; i < dinode->i_nblocks; i++, n++) {
+		free_block(dinode->i_blockaddr[i]);
+	}
+	return n;
+}
+
+// a read-only view of a directory block when the backend
+// maps the image, otherwise a copy into buf
+const struct FS::Dir* Filesystem::dir_block(uint32_t blk, struct FS::Dir* buf) {
+	const char* v = FS::view_block(blk);
+	if (v) return reinterpret_cast<const struct FS::Dir*>(v);
+	FS::read_block(reinterpret_cast<char*>(buf), blk, 0, FS::BLK_SIZE);
+	return buf;
 }
 
 int Filesystem::fread(int fid, int pid, int time) {
@@ -375,9 +2098,138 @@ int Filesystem::fwrite(int fid, int size, int pid, int time) {
 	return state;
 }
 
+// the process is done with the file, its transfer goes to
+// the aio worker and the file is released once it completes
 void Filesystem::fpop(int pid, int fid, int rw, int size) {
 	Log::i("*** fpoped %d\n", fid);
-	if (fid < 0 || fid > file_table.size()) return;
+	if (fid < 0 || fid >= file_table.size()) return;
+	if (rw != 1 && rw != 2) return;
+	struct FS::AioReq req;
+	req.pid = pid;
+	req.fid = fid;
+	req.rw = rw;
+	req.file = file_table[fid];
+	req.path = file_table[fid]->fname;
+	req.offset = 0; // reads pick theirs on the worker
+	req.size = max(size, 0);
+	req.result = 0;
+	if (rw == 2) { // writes append
+		req.size = min<int>(req.size, FS::AIO_MAX_XFER);
+		req.offset = file_table[fid]->offset;
+		file_table[fid]->offset += req.size;
+	}
+	idt(INTN::INT::REQ_CLK, &req.tick);
+	aio->submit(req);
+}
+
+// runs on the aio worker, read() and write() only take
+// file_lock around the bookkeeping, not the transfer
+int Filesystem::aio_exec(struct FS::AioReq& req) {
+	if (req.rw == 3) { // a close or age flush queued by da_queue
+		lock_guard<recursive_mutex> guard(file_lock);
+		da_flush(req.inode);
+		return 0;
+	}
+	if (req.rw == 1) { // a read instruction moves the next block
+		struct FS::File* f = req.file;
+		struct FS::Inode inode;
+		int index;
+		{
+			lock_guard<recursive_mutex> guard(file_lock);
+			index = walk(req.path, &inode, nullptr);
+			if (index == -1) return -1;
+			if (da_flush(index) && walk(req.path, &inode, nullptr) != index) return -1;
+		}
+		if (!inode.i_size) return 0;
+		if (f->rpos >= inode.i_size) f->rpos = 0; // rescan from the top
+		req.offset = f->rpos;
+		int n = static_cast<int>(min<uint64_t>(inode.i_size - f->rpos, FS::geo.blk_size));
+		char* buf = new char[n + 1]; // read() terminates the data
+		int res = read(req.path, buf, f->rpos, n);
+		delete[] buf;
+		if (res > 0) {
+			readahead(f, &inode, f->rpos, res);
+			f->rpos += res;
+		}
+		return res;
+	}
+	if (!req.size) return 0;
+	char* buf = new char[req.size];
+	memset(buf, 'a' + req.pid % 26, req.size);
+	bool res = write(req.path, buf, req.offset, req.size);
+	delete[] buf;
+	return res ? req.size : -1;
+}
+
+// a read that starts where the last one ended doubles the
+// window, up to RA_MAX_BLKS, anything else closes it. The next
+// window is fetched once the reader is halfway through this one,
+// off the kernel thread since this runs on the aio worker. Only
+// the block mapping is done under file_lock
+void Filesystem::readahead(struct FS::File* f, const struct FS::Inode* inode, uint32_t offset, uint32_t size) {
+	uint32_t last = (offset + size - 1) / FS::geo.blk_size + 1; // past the block just read
+	bool seq = offset == f->ra_next;
+	f->ra_next = offset + size;
+	if (!seq) {
+		f->ra_win = 0;
+		f->ra_end = last;
+		return;
+	}
+	if (!FS::cache || FS::dev->view(0, FS::geo.blk_size)) return; // nothing to gain over a mapping
+	f->ra_win = f->ra_win ? min(f->ra_win * 2, FS::RA_MAX_BLKS) : FS::RA_MIN_BLKS;
+	if (f->ra_end < last) f->ra_end = last;
+	if (f->ra_end >= last + f->ra_win / 2) return; // still far enough ahead
+	uint32_t nblks = static_cast<uint32_t>((inode->i_size + FS::geo.blk_size - 1) / FS::geo.blk_size);
+	uint32_t end = min(last + f->ra_win, nblks);
+	uint32_t lblk = f->ra_end;
+	vector<pair<uint32_t, uint32_t>> runs; // device block, count
+	{
+		lock_guard<recursive_mutex> guard(file_lock);
+		if (inode->i_flags != FS::EXT_MAGIC) {
+			for (; lblk < end; lblk++) {
+				int32_t db = file_blk(inode, lblk);
+				if (db < 0) break;
+				runs.push_back({ FS::data_blk(db), 1 });
+			}
+		}
+		else {
+			vector<struct FS::Extent> ext;
+			file_extents(inode, ext);
+			uint32_t base = 0; // first logical block of e
+			for (auto& e : ext) { // one prefetch per extent the window touches
+				if (lblk >= end) break;
+				if (lblk < base + e.len) {
+					uint32_t n = min(base + e.len, end) - lblk;
+					runs.push_back({ FS::data_blk(e.start + lblk - base), n });
+					lblk += n;
+				}
+				base += e.len;
+			}
+		}
+	}
+	for (auto& r : runs) FS::cache->prefetch(r.first, r.second);
+	f->ra_end = lblk;
+}
+
+// called once per tick, hands finished transfers back to the kernel
+void Filesystem::aio_reap() {
+	struct FS::AioReq req;
+	uint32_t now;
+	idt(INTN::INT::REQ_CLK, &now);
+	while (aio->reap(&req, now)) {
+		if (req.result < 0)
+			Log::w("(filesystem.cpp) aio_reap: transfer on %s failed.\n", req.path.c_str());
+		frelease(req.pid, req.fid, req.rw);
+	}
+}
+
+// a transfer outside file_lock has finished, file_lock held
+void Filesystem::io_done(int index) {
+	if (!--io_busy[index]) io_busy.erase(index);
+	io_cv.notify_all();
+}
+
+void Filesystem::frelease(int pid, int fid, int rw) {
 	if (rw == 1) {
 		filequeue[fid].first.remove(pid);
 		if (!filequeue[fid].first.size()) {
@@ -389,9 +2241,6 @@ void Filesystem::fpop(int pid, int fid, int rw, int size) {
 	}
 	else if (rw == 2) {
 		filequeue[fid].second.remove(pid);
-		/*char* dummy = new char[size];
-		write(file_table[fid]->fname, dummy, file_table[fid]->offset, size);
-		file_table[fid]->offset += size;*/
 		if (!filequeue[fid].second.size()) {
 			file_table[fid]->rw = 0;
 			for (auto v : filequeue[fid].first) {
@@ -402,26 +2251,25 @@ void Filesystem::fpop(int pid, int fid, int rw, int size) {
 }
 
 int Filesystem::open(string path, int rw, int truncate) {
+	lock_guard<recursive_mutex> guard(file_lock); // truncate races the aio worker
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path, inode, d);
+	int index = walk(path, inode, nullptr);
 	if (index == -1 || inode->i_mode != FS::File_t::File) {
 		Log::w("(filesystem.cpp) open: file not found.\n");
 		delete inode;
-		delete[] d;
 		return -1;
 	}
 	if (uid == inode->i_uid) {
 		if (!(inode->i_acl & FS::RD_OWNER)) {
 			Log::w("(filesystem.cpp) open: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode;
 			return -1;
 		}
 	}
 	else if(uid) {
 		if (!(inode->i_acl & FS::RD_OTHER)) {
 			Log::w("(filesystem.cpp) open: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode;
 			return -1;
 		}
 	}
@@ -430,29 +2278,38 @@ int Filesystem::open(string path, int rw, int truncate) {
 	}
 	for (int i = 0; i < file_table.size(); i++) {
 		if (file_table[i]->inode == index) {
-			file_table[i]->counter++;
+			if (!file_table[i]->counter++ && FS::icache) FS::icache->pin(index);
 			return i;
 		}
 	}
 	if (truncate) {
+		da_drop(index);
 		inode->i_size = 0;
 		FS::write_inode(inode, index);
 	}
 	delete inode;
-	delete[] d;
 	struct FS::File* f = new struct FS::File;
 	f->fname = path;
 	f->counter = 1;
 	f->offset = 0;
 	f->rw = 0;
 	f->inode = index;
+	f->rpos = 0;
+	f->ra_next = 0;
+	f->ra_win = 0;
+	f->ra_end = 0;
+	if (FS::icache) FS::icache->pin(index); // open files stay resident
 	file_table.push_back(f);
 	filequeue.resize(max(filequeue.size(), file_table.size()));
 	return file_table.size() - 1;
 }
 
 void Filesystem::close(int fd) {
-	file_table[fd]->counter--;
+	lock_guard<recursive_mutex> guard(file_lock);
+	if (!--file_table[fd]->counter) {
+		da_queue(file_table[fd]->inode);
+		if (FS::icache) FS::icache->unpin(file_table[fd]->inode);
+	}
 	/*if (!file_table[fd]->counter < 0) {
 		auto f = file_table.begin();
 		for (int i = 0; i < fd; i++, f++);
@@ -461,26 +2318,27 @@ void Filesystem::close(int fd) {
 }
 
 void Filesystem::reset_swapspace(string path) {
+	lock_guard<recursive_mutex> guard(file_lock);
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path, inode, d);
+	int index = walk(path, inode, nullptr);
 	if (index == -1) {
 		Log::w("(filesystem.cpp) reset_swapspace: swap file does not exist.\n");
 		delete inode;
-		delete[] d;
 		return;
 	}
 	if (inode->i_mode == FS::File_t::Dir) {
 		Log::w("(filesystem.cpp) reset_swapspace: invalid file.\n");
 		delete inode;
-		delete[] d;
 		return;
 	}
 	inode->i_size = 0;
 	FS::write_inode(inode, index);
+	delete inode;
 }
 
-bool Filesystem::create_swapspace(string path, string fname) {
+// nslots pages of BLK_SIZE
+bool Filesystem::create_swapspace(string path, string fname, uint32_t nslots) {
+	lock_guard<recursive_mutex> guard(file_lock);
 	string full_path = path + "/" + fname;
 	if (!path.size()) path = "/";
 	if (fname.find('/') != string::npos) {
@@ -491,89 +2349,73 @@ bool Filesystem::create_swapspace(string path, string fname) {
 		Log::w("(filesystem.cpp) create_swapspace: file name length exceeded.\n");
 		return false;
 	}
-	if (sb->nfreeblks < FS::MAX_N_BLKS) {
+	// several slots to a block larger than BLK_SIZE
+	uint32_t nblks = static_cast<uint32_t>((static_cast<uint64_t>(nslots) * FS::BLK_SIZE
+		+ FS::geo.blk_size - 1) / FS::geo.blk_size);
+	if (!nslots || sb->nfreeblks < da_reserved + nblks) {
 		Log::w("(filesystem.cpp) create_swapspace: not enough disk space.\n");
 		return false;
 	}
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(full_path, inode, d);
+	int index = walk(full_path, inode, nullptr);
 	if (index != -1) {
 		Log::w("(filesystem.cpp) create_swapspace: swap file exists.\n");
 		/*inode->i_size = 0;
 		FS::write_inode(inode, index);*/
 		delete inode;
-		delete[] d;
 		return false;
 	}
-	index = walk(path, inode, d);
+	index = walk(path, inode, nullptr);
 
 	if (inode->i_mode == FS::File_t::File) {
 		Log::w("(filesystem.cpp) create_swapspace: cannot create under file.\n");
 		delete inode;
-		delete[] d;
 		return false;
 	}
 	
 	struct FS::Inode* new_inode = new struct FS::Inode;
-	int in = 0;
-	int db = 0;
-	for (; in < FS::BLK_SIZE; in++) if (!imap[in]) {
-		imap[in] = 1; break;
+	memset(new_inode, 0, sizeof(struct FS::Inode));
+	int in = imap->alloc();
+	if (in == -1) {
+		Log::w("(filesystem.cpp) create_swapspace: no free inode.\n");
+		delete new_inode;
+		delete inode;
+		return false;
 	}
+	itable_touch(in);
 	new_inode->i_mode = FS::File_t::File;
-	new_inode->i_nblocks = FS::MAX_N_BLKS;
+	new_inode->i_flags = FS::EXT_MAGIC;
 	new_inode->i_nlinks = 1;
 	new_inode->i_size = 0;
-	int nblks = 0;
-	for (; db < FS::BLK_SIZE && nblks < FS::MAX_N_BLKS; db++) {
-		if (!dmap[db]) {
-			dmap[db] = 1;
-			new_inode->i_blockaddr[nblks++] = db;
-			sb->nfreeblks--;
-		}
-	}
-	sb->nfreeinodes--;
-
-	int i = 0;
-	for (i = 0; i < 8; i++) {
-		if (!d[i].type) {
-			strcpy(d[i].entry_name, fname.c_str());
-			if (i > 0) {
-				if (i != 7) {
-					d[i].next_entry = d[i - 1].next_entry;
-				}
-				else {
-					d[i].next_entry = 0;
-				}
-				d[i - 1].next_entry = sizeof(struct FS::Dir);
-			}
-			else {
-				d[i].next_entry = sizeof(struct FS::Dir);
-			}
-			d[i].type = FS::File_t::File;
-			d[i].inode = in;
-			break;
-		}
+	if (!file_extend(new_inode, nblks)) {
+		Log::w("(filesystem.cpp) create_swapspace: not enough disk space.\n");
+		imap->free(in);
+		delete new_inode;
+		delete inode;
+		return false;
 	}
-	if (i == 8) {
-		Log::w("(filesystem.cpp) create: dir full.\n");
+
+	if (!dir_add(inode, fname, in, FS::File_t::File)) {
+		Log::w("(filesystem.cpp) create_swapspace: dir full.\n");
+		file_free(new_inode);
+		imap->free(in);
 		delete new_inode;
+		delete inode;
 		return false;
 	}
 	inode->i_size += sizeof(struct FS::Dir);
 	FS::write_inode(inode, index);
 	FS::write_inode(new_inode, in);
-	FS::write_block(reinterpret_cast<char*>(d), 3 + FS::N_INODEBLKS + inode->i_blockaddr[0], 0, FS::BLK_SIZE);
+	if (FS::dcache) FS::dcache->insert(index, fname, in);
 	delete new_inode;
 	delete inode;
-	delete[] d;
 	set_pwd(pwd);
+	commit_if_full();
 	return true;
 }
 
 bool Filesystem::create(string path, string fname, FS::File_t type) {
-	//lock_guard<mutex> guard(file_lock);
+	lock_guard<recursive_mutex> guard(file_lock);
 	if (!path.size()) path = pwd;
 	if (fname.size() == 0 || fname.size() > FS::MAX_NAME_LEN) {
 		Log::w("(filesystem.cpp) create: invalid file name length.\n");
@@ -586,42 +2428,49 @@ bool Filesystem::create(string path, string fname, FS::File_t type) {
 	if (path.size() > 1 && path[path.size() - 1] == '/') 
 		path = path.substr(0, path.size() - 1);
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path + fname, inode, d);
+	int index = walk(path + "/" + fname, inode, nullptr);
 	if (index != -1) {
 		Log::w("(filesystem.cpp) create: file exist.\n");
 		delete inode;
-		delete[] d;
 		return false;
 	}
-	index = walk(path, inode, d);
+	index = walk(path, inode, nullptr);
 
 	if (inode->i_mode == FS::File_t::File) {
 		Log::w("(filesystem.cpp) create: cannot create under file.\n");
 		delete inode;
-		delete[] d;
 		return false;
 	}
 
-	struct FS::Inode* new_inode = new struct FS::Inode;
-	int in = 0;
-	int db = 0;
-	for (; in < FS::BLK_SIZE; in++) {
-		if (!imap[in]) {
-			imap[in] = 1; break;
-		}
+	if (sb->nfreeblks < da_reserved + 1) { // held data keeps its share
+		Log::w("(filesystem.cpp) create: not enough free data blocks.\n");
+		delete inode;
+		return false;
 	}
-	for (; db < FS::BLK_SIZE; db++) {
-		if (!dmap[db]) {
-			dmap[db] = 1; break;
-		}
+	struct FS::Inode* new_inode = new struct FS::Inode;
+	memset(new_inode, 0, sizeof(struct FS::Inode));
+	int in = imap->alloc();
+	int db = in == -1 ? -1 : dmap->alloc();
+	if (db == -1) {
+		Log::w("(filesystem.cpp) create: no free inode or data block.\n");
+		if (in != -1) imap->free(in);
+		delete new_inode;
+		delete inode;
+		return false;
 	}
+	itable_touch(in);
 	//cout << in << " " << db << endl;
 	new_inode->i_mode = type;
 	new_inode->i_nblocks = 1;
 	new_inode->i_nlinks = 1;
 	new_inode->i_size = 0;
-	new_inode->i_blockaddr[0] = db;
+	if (type == FS::File_t::File) {
+		new_inode->i_flags = FS::EXT_MAGIC;
+		new_inode->i_ext.e[0] = { static_cast<uint32_t>(db), 1 };
+	}
+	else {
+		new_inode->i_blockaddr[0] = db;
+	}
 	new_inode->i_uid = uid;
 	if (fname.size() > 2 && fname.substr(fname.size() - 2, fname.size()) == ".p") {
 		new_inode->i_acl = FS::ALL_OWNER | FS::ALL_OTHER;
@@ -629,41 +2478,19 @@ bool Filesystem::create(string path, string fname, FS::File_t type) {
 	else {
 		new_inode->i_acl = FS::RW_OWNER | FS::RW_OTHER;
 	}
-	sb->nfreeblks--;
-	sb->nfreeinodes--;
 
-	int i = 0;
-	for (i = 0; i < 8; i++) {
-		if (!d[i].type) {
-			strcpy(d[i].entry_name, fname.c_str());
-			if (i > 0) {
-				if (i != 7) {
-					d[i].next_entry = d[i - 1].next_entry;
-				}
-				else {
-					d[i].next_entry = 0;
-				}
-				d[i - 1].next_entry = sizeof(struct FS::Dir);
-			}
-			else {
-				d[i].next_entry = sizeof(struct FS::Dir);
-			}
-			d[i].type = type;
-			d[i].inode = in;
-			break;
-		}
-	}
-	if (i == 8) {
+	if (!dir_add(inode, fname, in, type)) {
 		Log::w("(filesystem.cpp) create: dir full.\n");
+		free_block(db);
+		imap->free(in);
 		delete new_inode;
 		delete inode;
-		delete[] d;
 		return false;
 	}
 	if (type == FS::File_t::Dir) {
 		new_inode->i_nlinks += 2;
 		new_inode->i_size = sizeof(struct FS::Dir) * 2;
-		struct FS::Dir* root_dir = new struct FS::Dir[2];
+		struct FS::Dir* root_dir = new struct FS::Dir[8](); // the block may be recycled
 		struct FS::Dir* d = &root_dir[0];
 		struct FS::Dir* dd = &root_dir[1];
 		strcpy(d->entry_name, ".");
@@ -674,46 +2501,61 @@ bool Filesystem::create(string path, string fname, FS::File_t type) {
 		dd->inode = index;
 		dd->type = FS::File_t::Dir;
 		dd->next_entry = 0;
-		FS::write_block(reinterpret_cast<char*>(root_dir), 3 + FS::N_INODEBLKS + db, 0, 
-			sizeof(struct FS::Dir) * 2);
+		FS::write_block(reinterpret_cast<char*>(root_dir), FS::data_blk(db), 0, 
+			FS::BLK_SIZE);
 		delete[] root_dir;	
 	}
 	inode->i_size += sizeof(struct FS::Dir);
 	FS::write_inode(inode, index);
 	FS::write_inode(new_inode, in);
-	FS::write_block(reinterpret_cast<char*>(d), 3 + FS::N_INODEBLKS + inode->i_blockaddr[0], 0, FS::BLK_SIZE);
+	if (FS::dcache) FS::dcache->insert(index, fname, in);
 	delete new_inode;
 	delete inode;
-	delete[] d;
 	set_pwd(pwd);
+	commit_if_full();
 	return true;
 }
 bool Filesystem::fdelete(string path) {
-	//lock_guard<mutex> guard(file_lock);
+	unique_lock<recursive_mutex> guard(file_lock);
 	if (path == pwd || path == ".") {
 		Log::w("(filesystem.cpp) fdelete: cannot delete pwd.\n");
 		return false;
 	}
+	if (path.size() > 1 && path[path.size() - 1] == '/')
+		path = path.substr(0, path.size() - 1); // normalize
+	auto slash = path.rfind('/');
+	string parent = slash == string::npos ? "." : (slash ? path.substr(0, slash) : "/");
+	string name = slash == string::npos ? path : path.substr(slash + 1);
+	if (!name.size() || name == "." || name == "..") {
+		Log::w("(filesystem.cpp) fdelete: invalid file name.\n");
+		return false;
+	}
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path, inode, d);
-	if (index == -1) {
+	struct FS::Inode* pinode = new struct FS::Inode;
+	int index = walk(path, inode, nullptr);
+	int pindex = index == -1 ? -1 : walk(parent, pinode, nullptr);
+	if (index == -1 || pindex == -1) {
 		Log::w("(filesystem.cpp) fdelete: file does not exist.\n");
-		delete inode; delete[] d;
+		delete inode; delete pinode;
 		return false;
 	}
+	if (io_busy.count(index)) { // its blocks are still being transferred
+		io_cv.wait(guard, [&] { return !io_busy.count(index); });
+		FS::read_inode(inode, index);
+		FS::read_inode(pinode, pindex);
+	}
 
 	if (uid == inode->i_uid) {
 		if (!(inode->i_acl & FS::WR_OWNER)) {
 			Log::w("(filesystem.cpp) fdelete: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode; delete pinode;
 			return false;
 		}
 	}
 	else if (uid) {
 		if (!(inode->i_acl & FS::WR_OTHER)) {
 			Log::w("(filesystem.cpp) fdelete: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode; delete pinode;
 			return false;
 		}
 	}
@@ -722,186 +2564,291 @@ bool Filesystem::fdelete(string path) {
 	}
 
 	if (inode->i_mode == FS::File_t::Dir) {
-		
 		if (inode->i_size > sizeof(struct FS::Dir) * 2) {
 			Log::w("(filesystem.cpp) fdelete: dir not empty.\n");
-			delete inode;
-			delete[] d;
+			delete inode; delete pinode;
 			return false;
 		}
-		for (int i = 0; i < inode->i_nblocks; i++) {
-				dmap[inode->i_blockaddr[i]] = 0;
-			}
-			imap[index] = 0;
-		// if (--inode->i_nlinks == 1) {
-		// 	for (int i = 0; i < inode->i_nblocks; i++) {
-		// 		dmap[inode->i_blockaddr[i]] = 0;
-		// 	}
-		// 	imap[index] = 0;
-		// }
-		int idx = 0;
-		int last = 0;
-		for(int i = 0; i < 8; i++) {
-			d[i].type = FS::File_t::None;
-		}
-		sb->nfreeblks += inode->i_nblocks;
-		sb->nfreeinodes++;
+		dir_free(inode);
+		imap->free(index);
 		FS::write_inode(inode, index);
-		int id = 0;
-		for( ; strcmp(d[id].entry_name, ".."); id++) ;
-		FS::read_inode(inode, d[id].inode);
-		inode->i_size -= sizeof(struct FS::Dir);
-		FS::read_block(reinterpret_cast<char*>(d), 3 + FS::N_INODEBLKS + inode->i_blockaddr[0], 0, FS::BLK_SIZE);
-		for(int i = 0; i < 8; i++) {
-			if(d[i].inode == index) {
-				d[i].type = FS::File_t::None;
-			}
-		}
-		FS::write_block(reinterpret_cast<char*>(d), 3 + FS::N_INODEBLKS + inode->i_blockaddr[0], 0, FS::BLK_SIZE);
-		FS::write_inode(inode, d[id].inode);
+		if (FS::dcache) FS::dcache->drop_dir(index);
 	}
 	else if (inode->i_mode == FS::File_t::File) {
+		bool swapping = false;
+		{
+			lock_guard<mutex> sguard(swap_lock);
+			for (auto& v : swap_areas) swapping = swapping || v.inode == index;
+		}
+		if (swapping) {
+			Log::w("(filesystem.cpp) fdelete: swapspace in use.\n");
+			delete inode; delete pinode;
+			return false;
+		}
 		if (--inode->i_nlinks == 0) {
-			for (int i = 0; i < inode->i_nblocks; i++) {
-				dmap[inode->i_blockaddr[i]] = 0;
-			}
-			imap[index] = 0;
-		}
-		int idx = 0;
-		int last = 0;
-		for(int i = 0; i < 8; i++) {
-			if (d[i].type && (d[i].inode == index)) {
-				d[i].type = FS::File_t::None;
-				d[last].next_entry = d[idx].next_entry;
-				break;
-			}
-			last = i;
+			da_drop(index);
+			file_free(inode);
+			imap->free(index);
 		}
-		sb->nfreeblks += inode->i_nblocks;
-		sb->nfreeinodes++;
 		FS::write_inode(inode, index);
-		int id = 0;
-		for( ; strcmp(d[id].entry_name, "."); id++) ;
-		FS::read_inode(inode, d[id].inode);
-		inode->i_size -= sizeof(struct FS::Dir);
-		FS::read_block(reinterpret_cast<char*>(d), 3 + FS::N_INODEBLKS + inode->i_blockaddr[0], 0, FS::BLK_SIZE);
-		for(int i = 0; i < 8; i++) {
-			if(d[i].inode == index) {
-				d[i].type = FS::File_t::None;
-			}
-		}
-		FS::write_block(reinterpret_cast<char*>(d), 3 + FS::N_INODEBLKS + inode->i_blockaddr[0], 0, FS::BLK_SIZE);
-		FS::write_inode(inode, d[id].inode);
 	}
+	dir_remove(pinode, name);
+	pinode->i_size -= sizeof(struct FS::Dir);
+	FS::write_inode(pinode, pindex);
+	if (FS::dcache) FS::dcache->insert(pindex, name, -1);
 	delete inode;
-	delete[] d;
+	delete pinode;
 	set_pwd(pwd);
+	commit_if_full();
 	return true;
 }
 
+// blocks to hold back for nnew new data blocks, each may start
+// an extent of its own and those may need new ExtentBlocks
+static uint32_t da_cost(uint32_t nnew) {
+	const uint32_t per_blk = sizeof(FS::ExtentBlock::e) / sizeof(struct FS::Extent);
+	return nnew + (nnew + per_blk - 1) / per_blk;
+}
+
 bool Filesystem::write(string path, char* buf, uint32_t offset, size_t size) {
-	//lock_guard<mutex> guard(file_lock);
+	lock_guard<recursive_mutex> guard(file_lock);
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path, inode, d);
+	int index = walk(path, inode, nullptr);
 	if (index == -1) {
 		Log::w("(filesystem.cpp) write: file does not exist.\n");
-		delete inode; delete[] d;
+		delete inode;
 		return false;
 	}
 	if (inode->i_mode != FS::File_t::File) {
 		Log::w("(filesystem.cpp) write: cannot write into dir.\n");
-		delete inode; delete[] d;
+		delete inode;
 		return false;
 	}
 	if (uid == inode->i_uid) {
 		if (!(inode->i_acl & FS::WR_OWNER)) {
 			Log::w("(filesystem.cpp) write: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode;
 			return false;
 		}
 	}
 	else if (uid) {
 		if (!(inode->i_acl & FS::WR_OTHER)) {
 			Log::w("(filesystem.cpp) write: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode;
 			return false;
 		}
 	}
 	else {
 		//admin
 	}
-	if (offset > inode->i_size) {
+	auto v = dirty_files.find(index);
+	if (v != dirty_files.end() && v->second.nospc) {
+		Log::w("(filesystem.cpp) write: no space for data written earlier.\n");
+		delete inode;
+		return false;
+	}
+	uint64_t cur = da_size(index, inode);
+	if (offset > cur) {
 		Log::w("(filesystem.cpp) write: invalid offset.\n");
-		delete inode; delete[] d;
+		delete inode;
 		return false;
 	}
-	if (offset + size > inode->i_size) {
-		int nblks = static_cast<int>(
-			ceil((offset + size - inode->i_size) / FS::BLK_SIZE) );
-		if (sb->nfreeblks < nblks) {
-			Log::w("(filesystem.cpp) write: not enough free data blocks.\n");
-			delete inode; delete[] d;
-			return false;
-		}
-		if (inode->i_nblocks + nblks > FS::MAX_N_BLKS) {
-			Log::w("(filesystem.cpp) write: max file size exceeded.\n");
-			delete inode; delete[] d;
-			return false;
-		}
-		for (int i = inode->i_nblocks; i < inode->i_nblocks + nblks; i++) {
-			int db = -1;
-			for (; dmap[db]; db++);
-			inode->i_blockaddr[i] = db;
-		}
-		inode->i_nblocks += nblks;
+	uint64_t end = static_cast<uint64_t>(offset) + size;
+	uint32_t need = static_cast<uint32_t>((end + FS::geo.blk_size - 1) / FS::geo.blk_size);
+	uint32_t nres = da_cost(need > inode->i_nblocks ? need - inode->i_nblocks : 0);
+	uint32_t held = v == dirty_files.end() ? 0 : v->second.nres;
+	if (nres > held && sb->nfreeblks < da_reserved + nres - held) {
+		Log::w("(filesystem.cpp) write: not enough free data blocks.\n");
+		delete inode;
+		return false;
 	}
-	inode->i_size = offset + size;//inode->i_size < (offset + size) ? 
-		//offset + size : inode->i_size;
-	auto blk_off = static_cast<int>(floor(offset / FS::BLK_SIZE));
-	offset %= FS::BLK_SIZE;
-	for (int i = blk_off; i < inode->i_nblocks; i++) {
-		if (size + offset > FS::BLK_SIZE) {
-			FS::write_block(buf, 3 + FS::N_INODEBLKS + inode->i_blockaddr[i], offset, FS::BLK_SIZE - offset);
-			offset = 0;
-			size -= (FS::BLK_SIZE - offset);
+	if (v == dirty_files.end()) {
+		v = dirty_files.emplace(index, FS::DirtyFile()).first;
+		v->second.since = da_clock;
+		v->second.nres = 0;
+		v->second.queued = false;
+		v->second.nospc = false;
+	}
+	struct FS::DirtyFile& df = v->second;
+	da_reserved = da_reserved + nres - df.nres;
+	df.nres = nres;
+	df.size = end; // a write also cuts the file at its end
+	uint32_t lblk = offset / FS::geo.blk_size;
+	uint32_t off = offset % FS::geo.blk_size;
+	for (; size; lblk++) {
+		uint32_t n = static_cast<uint32_t>(min<size_t>(size, FS::geo.blk_size - off));
+		auto b = df.blks.find(lblk);
+		if (b == df.blks.end()) {
+			b = df.blks.emplace(lblk, FS::HeldBlock()).first;
+			b->second.data = new char[FS::geo.blk_size];
+			memset(b->second.data, 0, FS::geo.blk_size);
+			// the flush reads in the rest of a block already on disk
+			if (n != FS::geo.blk_size && lblk < inode->i_nblocks) b->second.written.assign(FS::geo.blk_size, false);
+			da_held++;
 		}
-		else {
-			FS::write_block(buf, 3 + FS::N_INODEBLKS + inode->i_blockaddr[i], offset, size);
-			break;
+		struct FS::HeldBlock& hb = b->second;
+		memcpy(hb.data + off, buf, n);
+		if (hb.written.size()) {
+			fill(hb.written.begin() + off, hb.written.begin() + off + n, true);
+			if (find(hb.written.begin(), hb.written.end(), false) == hb.written.end()) hb.written.clear();
 		}
+		buf += n;
+		size -= n;
+		off = 0;
 	}
-	FS::write_inode(inode, index);
 	delete inode;
-	delete[] d;
+	if (da_held > FS::DA_MAX_BLKS) da_flush(index);
+	return true;
+}
+
+// allocate and write out the data held for one file. The
+// caller holds file_lock once, it is let go for the transfer.
+// False if nothing was held or in flight, so nothing moved
+bool Filesystem::da_flush(int index) {
+	bool waited = da_busy.count(index);
+	io_cv.wait(file_lock, [&] { return !da_busy.count(index); }); // one at a time per file
+	auto v = dirty_files.find(index);
+	if (v == dirty_files.end()) return waited;
+	struct FS::Inode inode;
+	FS::read_inode(&inode, index);
+	uint32_t need = static_cast<uint32_t>((v->second.size + FS::geo.blk_size - 1) / FS::geo.blk_size);
+	if (need > inode.i_nblocks) {
+		da_reserved -= v->second.nres; // file_extend takes from the reserve
+		if (!file_extend(&inode, need - inode.i_nblocks)) {
+			// keep the data, a later flush retries and write() reports it
+			Log::w("(filesystem.cpp) da_flush: no space to map file blocks, data held.\n");
+			da_reserved += v->second.nres;
+			v->second.nospc = true;
+			v->second.queued = false;
+			v->second.since = da_clock;
+			return waited;
+		}
+		v->second.nres = 0;
+	}
+	struct FS::DirtyFile df = v->second;
+	dirty_files.erase(v);
+	da_reserved -= df.nres;
+	vector<struct FS::Extent> ext;
+	vector<struct FS::BlockIO> io;
+	vector<struct FS::BlockIO> olds; // disk copies of partly written blocks
+	file_extents(&inode, ext);
+	auto e = ext.begin();
+	uint32_t base = 0; // first logical block of e
+	for (auto& b : df.blks) {
+		while (e != ext.end() && b.first >= base + e->len) base += (e++)->len;
+		if (e == ext.end()) break; // past i_nblocks, a later write cut the file
+		io.push_back({ FS::data_blk(e->start + b.first - base), b.second.data });
+		if (b.second.written.size()) olds.push_back({ io.back().blk, nullptr });
+	}
+	vector<char> old(olds.size() * FS::geo.blk_size);
+	for (size_t i = 0; i < olds.size(); i++) olds[i].buf = &old[i * FS::geo.blk_size];
+	// the blocks are mapped, the size follows once the data is home
+	FS::write_inode(&inode, index);
+	da_busy[index] = df.size;
+	io_busy[index]++;
+	file_lock.unlock();
+	FS::read_blocks(olds);
+	size_t k = 0;
+	for (auto& b : df.blks) {
+		if (!b.second.written.size()) continue;
+		if (k == olds.size()) break;
+		for (uint32_t i = 0; i < FS::geo.blk_size; i++)
+			if (!b.second.written[i]) b.second.data[i] = old[k * FS::geo.blk_size + i];
+		k++;
+	}
+	FS::write_blocks(io);
+	file_lock.lock();
+	if (!da_cut.erase(index)) {
+		FS::read_inode(&inode, index);
+		inode.i_size = df.size;
+		FS::write_inode(&inode, index);
+	}
+	da_busy.erase(index);
+	io_done(index);
+	for (auto& b : df.blks) delete[] b.second.data;
+	da_held -= df.blks.size();
+	commit_if_full();
 	return true;
 }
 
+// hand a file's held data to the aio worker, so the kernel
+// thread never waits for the allocation or the transfer
+void Filesystem::da_queue(int index) {
+	auto v = dirty_files.find(index);
+	if (v == dirty_files.end() || v->second.queued) return;
+	v->second.queued = true;
+	struct FS::AioReq req;
+	req.pid = -1;
+	req.fid = -1;
+	req.rw = 3;
+	req.file = nullptr;
+	req.inode = index;
+	req.offset = 0;
+	req.size = 0;
+	req.result = 0;
+	idt(INTN::INT::REQ_CLK, &req.tick);
+	aio->submit(req);
+}
+
+// forget held data, the file is being truncated or freed
+void Filesystem::da_drop(int index) {
+	if (da_busy.count(index)) da_cut.insert(index); // a flush in flight keeps the size
+	auto v = dirty_files.find(index);
+	if (v == dirty_files.end()) return;
+	for (auto& b : v->second.blks) delete[] b.second.data;
+	da_held -= v->second.blks.size();
+	da_reserved -= v->second.nres;
+	dirty_files.erase(v);
+}
+
+void Filesystem::da_flush_all() {
+	for (;;) { // a file with no space stays held
+		auto v = find_if(dirty_files.begin(), dirty_files.end(),
+			[](const pair<const int, struct FS::DirtyFile>& d) { return !d.second.nospc; });
+		if (v == dirty_files.end()) break;
+		da_flush(v->first);
+	}
+}
+
+// the size a file has once what is held or in flight lands
+uint64_t Filesystem::da_size(int index, const struct FS::Inode* inode) {
+	auto v = dirty_files.find(index);
+	if (v != dirty_files.end()) return v->second.size;
+	auto f = da_busy.find(index);
+	if (f != da_busy.end() && !da_cut.count(index)) return f->second;
+	return inode->i_size;
+}
+
+void Filesystem::set_dirty_age(uint32_t ticks) {
+	lock_guard<recursive_mutex> guard(file_lock);
+	da_age = ticks;
+}
+
 void Filesystem::chmod(string path, int mode) {
+	lock_guard<recursive_mutex> guard(file_lock);
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path, inode, d);
+	int index = walk(path, inode, nullptr);
 	if (index == -1) {
 		Log::w("(filesystem.cpp) chmod: file does not exist.\n");
-		delete inode; delete[] d;
+		delete inode;
 		return;
 	}
 	if (inode->i_mode != FS::File_t::File) {
 		Log::w("(filesystem.cpp) chmod: chmod on directory.\n");
-		delete inode; delete[] d;
+		delete inode;
 		return;
 	}
 	if (uid == inode->i_uid) {
 		if (!(inode->i_acl & FS::WR_OWNER)) {
 			Log::w("(filesystem.cpp) chmod: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode;
 			return;
 		}
 	}
 	else if (uid) {
 		if (!(inode->i_acl & FS::WR_OTHER)) {
 			Log::w("(filesystem.cpp) chmod: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode;
 			return;
 		}
 	}
@@ -910,74 +2857,116 @@ void Filesystem::chmod(string path, int mode) {
 	}
 	inode->i_acl = mode;
 	FS::write_inode(inode, index);
-	delete inode; delete[] d;
+	delete inode;
 }
 
-int Filesystem::write_swapspace(string path, char* buf, int blk) {
-	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path, inode, d);
-	if (inode->i_mode != FS::File_t::File) {
-		Log::w("(filesystem.cpp) write_swapspace: invalid swapspace.\n");
-		delete inode; delete[] d;
+// pin a swap file, the area number for swap_io, -1 on error
+int Filesystem::swap_on(string path) {
+	lock_guard<recursive_mutex> guard(file_lock);
+	struct FS::Inode inode;
+	int index = walk(path, &inode, nullptr);
+	if (index == -1 || inode.i_mode != FS::File_t::File) {
+		Log::w("(filesystem.cpp) swap_on: invalid swapspace.\n");
 		return -1;
 	}
-	if (inode->i_size == 15 * FS::BLK_SIZE) {
-		Log::w("(filesystem.cpp) write_swapspace: swapspace full.\n");
-		delete inode; delete[] d;
-		return -2;
+	{
+		lock_guard<mutex> sguard(swap_lock);
+		for (size_t i = 0; i < swap_areas.size(); i++)
+			if (swap_areas[i].inode == index) return static_cast<int>(i);
 	}
-	FS::write_block(buf, 3 + FS::N_INODEBLKS + inode->i_blockaddr[blk], 0, FS::BLK_SIZE);
-	inode->i_size += FS::BLK_SIZE;
-	FS::write_inode(inode, index);
-	delete inode;
-	delete[] d;
-	return blk;
+	if (da_flush(index)) FS::read_inode(&inode, index);
+	auto held = dirty_files.find(index);
+	if (held != dirty_files.end() && held->second.nospc) {
+		Log::w("(filesystem.cpp) swap_on: no space for data written earlier.\n");
+		return -1;
+	}
+	vector<struct FS::Extent> ext;
+	file_extents(&inode, ext);
+	struct FS::SwapArea area;
+	area.inode = index;
+	uint32_t per_blk = FS::geo.blk_size / FS::BLK_SIZE; // slots are BLK_SIZE
+	for (auto& e : ext) {
+		for (uint32_t i = 0; i < e.len; i++) {
+			uint32_t blk = FS::data_blk(e.start + i);
+			// later writes bypass the cache and the log
+			if (FS::cache) FS::cache->forget(blk);
+			if (FS::journal) FS::journal->revoke(blk);
+			for (uint32_t s = 0; s < per_blk; s++)
+				area.slots.push_back(static_cast<uint64_t>(blk) * FS::geo.blk_size
+					+ s * FS::BLK_SIZE);
+		}
+	}
+	if (FS::icache) FS::icache->pin(index);
+	lock_guard<mutex> sguard(swap_lock);
+	swap_areas.push_back(area);
+	return static_cast<int>(swap_areas.size()) - 1;
 }
 
-int Filesystem::read_swapspace(string path, char* buf, int blk) {
-	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path, inode, d);
-	if (inode->i_mode != FS::File_t::File) {
-		Log::w("(filesystem.cpp) read_swapspace: invalid swapspace.\n");
-		delete inode; delete[] d;
+int Filesystem::swap_slots(int area) {
+	lock_guard<mutex> guard(swap_lock);
+	if (area < 0 || static_cast<size_t>(area) >= swap_areas.size()) return 0;
+	return static_cast<int>(swap_areas[area].slots.size());
+}
+
+// move n pages from slot on, 0 on success. Slots that are
+// also adjacent on the device go in one transfer. Only
+// swap_lock is taken, the slots are fixed once the area is on
+int Filesystem::swap_io(int area, int slot, int n, char* buf, bool wr) {
+	lock_guard<mutex> guard(swap_lock);
+	if (area < 0 || static_cast<size_t>(area) >= swap_areas.size() || slot < 0 || n < 0
+		|| static_cast<size_t>(slot) + n > swap_areas[area].slots.size()) {
+		Log::w("(filesystem.cpp) swap_io: slot out of range.\n");
 		return -1;
 	}
-	FS::read_block(buf, 3 + FS::N_INODEBLKS + inode->i_blockaddr[blk], 0, FS::BLK_SIZE);
-	inode->i_size -= FS::BLK_SIZE;
-	FS::write_inode(inode, index);
-	delete inode;
-	delete[] d;
-	return blk;
+	const vector<uint64_t>& slots = swap_areas[area].slots;
+	bool res = true;
+	for (int i = slot; i < slot + n;) {
+		int j = i + 1;
+		while (j < slot + n && slots[j] == slots[j - 1] + FS::BLK_SIZE) j++;
+		uint32_t size = (j - i) * FS::BLK_SIZE;
+		char* p = buf + static_cast<size_t>(i - slot) * FS::BLK_SIZE;
+		res &= wr ? FS::dev->write(p, slots[i], size) : FS::dev->read(p, slots[i], size);
+		i = j;
+	}
+	return res ? 0 : -1;
 }
 
 int Filesystem::read(string path, char* buf, uint32_t offset, int size) {
-	//lock_guard<mutex> guard(file_lock);
+	unique_lock<recursive_mutex> guard(file_lock);
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* d = new struct FS::Dir[8];
-	int index = walk(path, inode, d);
+	int index = walk(path, inode, nullptr);
 	if (index == -1) {
 		Log::w("(filesystem.cpp) read: file does not exist.\n");
-		delete inode; delete[] d;
+		delete inode;
+		return -1;
+	}
+	if (da_flush(index) && walk(path, inode, nullptr) != index) { // held data first
+		Log::w("(filesystem.cpp) read: file does not exist.\n");
+		delete inode;
+		return -1;
+	}
+	auto held = dirty_files.find(index);
+	if (held != dirty_files.end() && held->second.nospc) { // the disk copy is stale
+		Log::w("(filesystem.cpp) read: no space for data written earlier.\n");
+		delete inode;
 		return -1;
 	}
 	if (inode->i_mode != FS::File_t::File) {
 		Log::w("(filesystem.cpp) read: cannot read from dir.\n");
-		delete inode; delete[] d;
+		delete inode;
 		return -1;
 	}
 	if (uid == inode->i_uid) {
 		if (!(inode->i_acl & FS::RD_OWNER)) {
 			Log::w("(filesystem.cpp) read: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode;
 			return -1;
 		}
 	}
 	else if (uid) {
 		if (!(inode->i_acl & FS::RD_OTHER)) {
 			Log::w("(filesystem.cpp) read: permission denied.\n");
-			delete inode; delete[] d;
+			delete inode;
 			return -1;
 		}
 	}
@@ -990,28 +2979,47 @@ int Filesystem::read(string path, char* buf, uint32_t offset, int size) {
 	}
 	if (offset + size > inode->i_size) {
 		Log::w("(filesystem.cpp) read: file size exceed.\n");
-		delete inode; delete[] d;
+		delete inode;
 		return -1;
 	}
 	int rsize = size;
-	auto blk_off = static_cast<int>(floor(offset / FS::BLK_SIZE));
-	offset %= FS::BLK_SIZE;
-	for (int i = blk_off; i < inode->i_nblocks; i++) {
-		if (size + offset > FS::BLK_SIZE) {
-			FS::read_block(buf, 3 + FS::N_INODEBLKS + inode->i_blockaddr[i], offset, FS::BLK_SIZE - offset);
-			offset = 0;
-			size -= (FS::BLK_SIZE - offset);
-			buf += (FS::BLK_SIZE - offset);
+	vector<struct FS::Extent> ext;
+	vector<struct FS::BlockIO> io; // partial blocks land in copies
+	vector<pair<char*, pair<const char*, uint32_t>>> merge; // dest, copy, bytes
+	char* part = new char[2 * FS::geo.blk_size]; // head and tail block copies
+	char* next = part;
+	file_extents(inode, ext);
+	uint32_t lblk = offset / FS::geo.blk_size;
+	uint32_t off = offset % FS::geo.blk_size;
+	for (auto& e : ext) {
+		if (!size) break;
+		if (lblk >= e.len) {
+			lblk -= e.len;
+			continue;
 		}
-		else {
-			FS::read_block(buf, 3 + FS::N_INODEBLKS + inode->i_blockaddr[i], offset, size);
-			buf += size;
-			break;
+		for (uint32_t i = lblk; i < e.len && size; i++) {
+			int n = min<int>(size, FS::geo.blk_size - off);
+			if (n == static_cast<int>(FS::geo.blk_size)) io.push_back({ FS::data_blk(e.start + i), buf });
+			else {
+				io.push_back({ FS::data_blk(e.start + i), next });
+				merge.push_back({ buf, { next + off, static_cast<uint32_t>(n) } });
+				next += FS::geo.blk_size;
+			}
+			buf += n;
+			size -= n;
+			off = 0;
 		}
+		lblk = 0;
 	}
+	io_busy[index]++; // the blocks stay this file's, fdelete waits
+	guard.unlock();
+	FS::read_blocks(io);
+	for (auto& m : merge) memcpy(m.first, m.second.first, m.second.second);
 	*buf = 0;
+	delete[] part;
+	guard.lock();
+	io_done(index);
 	delete inode;
-	delete[] d;
 	return rsize;
 }
 
@@ -1057,6 +3065,7 @@ void Filesystem::set_pwd(string path) {
 	struct FS::Inode* inode = new struct FS::Inode;
 	struct FS::Dir* dir = new struct FS::Dir[8];
 	int index = walk(path, inode, dir);
+	if (index != -1) pwd_index = index;
 
 	delete pwd_inode;
 	pwd_inode = inode;
@@ -1066,15 +3075,29 @@ void Filesystem::set_pwd(string path) {
 	if(path != pwd) set_pwd_str(path);
 }
 
+vector<struct FS::Dir> Filesystem::list_dir(string path) {
+	vector<struct FS::Dir> entries;
+	struct FS::Inode inode;
+	if (walk(path, &inode, nullptr) != -1 && inode.i_mode != FS::File_t::File) {
+		dir_entries(&inode, entries);
+	}
+	return entries;
+}
+
+int64_t Filesystem::file_size(string path) {
+	lock_guard<recursive_mutex> guard(file_lock);
+	struct FS::Inode inode;
+	int index = walk(path, &inode, nullptr);
+	if (index == -1 || inode.i_mode != FS::File_t::File) return -1;
+	return static_cast<int64_t>(da_size(index, &inode));
+}
+
 int Filesystem::exist(string path) {
-	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* dir = new struct FS::Dir[8];
-	if (walk(path, inode, dir) == -1) {
+	struct FS::Inode inode;
+	if (walk(path, &inode, nullptr) == -1) {
 		return 0;
 	}
 	else {
-		return inode->i_mode;
+		return inode.i_mode;
 	}
-	delete inode;
-	delete[] dir;
 }
\ No newline at end of file
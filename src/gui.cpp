@@ -38,9 +38,8 @@ static struct TreeItem* now_tree_node;
 
 void ls_root(Kernel* kernel, string path) {
     struct FS::Inode* inode = new struct FS::Inode;
-    struct FS::Dir* dir = new struct FS::Dir[8];
-    int idx = kernel->fs->walk(path, inode, dir);
-    for (int i = 0; i < 8; i++) {
+    vector<struct FS::Dir> dir = kernel->fs->list_dir(path);
+    for (size_t i = 0; i < dir.size(); i++) {
         if (dir[i].type == FS::File_t::None) continue; 
         string name{ dir[i].entry_name };
         if (dir[i].type == FS::File_t::Dir) {
@@ -59,7 +58,6 @@ void ls_root(Kernel* kernel, string path) {
         }
     }
     delete inode;
-    delete[] dir;
 }
 static int litem = 0;
 void rec_tree(struct TreeItem* root) {
@@ -83,6 +81,7 @@ static bool file_editor = false;
 static string fs_node_full_path{};
 static bool is_open_fstree = true;
 static bool mem_set = false;
+static bool fstree_clipped = false; // file larger than buf_fstree, view only
 
 static vector<const char*> states = {
         "Newborn",
@@ -146,9 +145,12 @@ const char* pas[5] = {
     "PR",
     "MQ"
 };
-const char* mas[2] = {
+const char* mas[5] = {
     "FIFO",
-    "LRU"
+    "LRU",
+    "CLOCK",
+    "2Q",
+    "ARC"
 };
 const char* dummy_labels[52] = {
     "A", "B", "C", "D", "E", "F", "G", "H",
@@ -259,6 +261,7 @@ void main_window(Kernel* kernel) {
     static double avgturnaround = 0;
     static double cpurate = 0;
     static double systp = 0;
+    static double accrate = 0;
 
     while (!glfwWindowShouldClose(window)) {
         // Poll and handle events (inputs, window resize, etc.)
@@ -288,6 +291,7 @@ void main_window(Kernel* kernel) {
             avgturnaround = kernel->statistic();
             cpurate = kernel->sch->cpu_rate();
             systp = kernel->sch->throughput();
+            accrate = kernel->access_rate();
             alg = kernel->alg();
             if (palg >= 0 && malg >= 0 &&
                 (strcmp(pas[palg], alg.first.c_str())
@@ -313,6 +317,12 @@ void main_window(Kernel* kernel) {
                     maa = MM::Algorithm::FIFO; break;
                 case 1:
                     maa = MM::Algorithm::LRU; break;
+                case 2:
+                    maa = MM::Algorithm::CLOCK; break;
+                case 3:
+                    maa = MM::Algorithm::TWO_Q; break;
+                case 4:
+                    maa = MM::Algorithm::ARC; break;
                 default:
                     maa = MM::Algorithm::NONE; break;
                 }
@@ -358,6 +368,7 @@ void main_window(Kernel* kernel) {
                         ImGui::Text("System Average Turnaround Time: %.2f", avgturnaround);
                         ImGui::Text("System CPU Usage: %.2f%%", cpurate);
                         ImGui::Text("System Throughput: %.2f/60Ticks", systp);
+                        ImGui::Text("Memory Accesses: %.0f/s", accrate);
                         ImGui::Separator();
                         ImGui::Text("Process Scheduler: %s", alg.first.c_str());
                         ImGui::SameLine();
@@ -366,7 +377,7 @@ void main_window(Kernel* kernel) {
                         ImGui::Text("Memory Allocator: %s", alg.second.c_str());
                         ImGui::SameLine();
                         ImGui::SetNextItemWidth(100.0f);
-                        ImGui::Combo("##ma", &malg, mas, 2);
+                        ImGui::Combo("##ma", &malg, mas, 5);
                         ImGui::Separator();
                         ImGui::Text("System Filetable:");
                         if (!sft_info.size()) {
@@ -527,8 +538,7 @@ void main_window(Kernel* kernel) {
                                         path = path.substr(0, path.size() - 1);
                                     if (!path.size()) path = pwd;
                                     string name = string(sname);
-                                    kernel->pg->new_swap(path + "/" + name);
-                                    kernel->fs->create_swapspace(path + "/", name);
+                                    kernel->mkswap(path, name);
                                     memset(sname, 0, FS::MAX_NAME_LEN);
                                     memset(spath, 0, FS::MAX_NAME_LEN);
                                     delete tree_root;
@@ -655,7 +665,10 @@ void main_window(Kernel* kernel) {
                         if (file_editor) {
                             if (!mem_set) {
                                 memset(buf_fstree, 0, FS::BLK_SIZE * FS::MAX_N_BLKS);
-                                kernel->fs->read(fs_node_full_path, buf_fstree, 0, -1);
+                                int64_t fsize = kernel->fs->file_size(fs_node_full_path);
+                                fstree_clipped = fsize >= static_cast<int64_t>(sizeof(buf_fstree));
+                                kernel->fs->read(fs_node_full_path, buf_fstree, 0,
+                                    fstree_clipped ? sizeof(buf_fstree) - 1 : -1);
                                 mem_set = true;
                             }
                             ImGui::Separator();
@@ -671,7 +684,7 @@ void main_window(Kernel* kernel) {
                             }
                             ImGui::SameLine();
                             if (ImGui::Button("Save")) {
-                                if (edit) {
+                                if (edit && !fstree_clipped) {
                                     kernel->fs->write(fs_node_full_path,
                                         buf_fstree, 0, strlen(buf_fstree));
                                 }
@@ -724,7 +737,7 @@ void main_window(Kernel* kernel) {
                     ImGui::End();
 
                     ImGui::Begin("Process States", 0, status_flags);
-                    if (ImGui::BeginTable("Process States", 11, prtbl_flags)) {
+                    if (ImGui::BeginTable("Process States", 12, prtbl_flags)) {
                         ImGui::TableSetupColumn("..");
                         ImGui::TableSetupColumn("Pid");
                         ImGui::TableSetupColumn("Name");
@@ -736,6 +749,7 @@ void main_window(Kernel* kernel) {
                         ImGui::TableSetupColumn("IO Time");
                         ImGui::TableSetupColumn("ETA");
                         ImGui::TableSetupColumn("PF Rate(%)");
+                        ImGui::TableSetupColumn("TLB Hit(%)");
                         ImGui::TableHeadersRow();
                         for (auto v : process_states) {
                             ImGui::TableNextRow();
@@ -754,7 +768,7 @@ void main_window(Kernel* kernel) {
                                 ImGui::PopID();
                             }
                             
-                            for (int i = 0; i < 10; i++) {
+                            for (int i = 0; i < 11; i++) {
                                 ImGui::TableSetColumnIndex(i+1);
                                 ImGui::Text("%s", v[i].c_str());
                                 ImGui::SameLine();
@@ -1,17 +1,19 @@
 #include "../include/kernel.h"
 
-Kernel::Kernel(PR::Algorithm pa, MM::Algorithm ma, uint64_t uid) : uid(uid) {
+Kernel::Kernel(PR::Algorithm pa, MM::Algorithm ma, uint64_t uid, const FS::MkfsOptions& mkfs,
+	uint32_t zswap)
+	: uid(uid) {
 	function<void(int, void*)> idt = bind(&Kernel::int_handler, this, placeholders::_1, placeholders::_2);
 	pg = new PageMemoryModel(idt,
 		MM::PHYS_MEM_SIZE, MM::PAGE_SIZE);
-	fs = new Filesystem(idt, uid);
+	pg->set_zswap(zswap);
+	fs = new Filesystem(idt, uid, FS::Backend::Stream, mkfs);
 	sch = new Scheduler(idt,
 		pa, ma);
 	if(!fs->exist("/.swap")) fs->create_swapspace("", ".swap");
-	vector<string> swaps = pg->get_swaps();
-	for (auto ss : swaps) {
-		fs->reset_swapspace(ss);
-	}
+	fs->reset_swapspace("/.swap");
+	int area = fs->swap_on("/.swap");
+	if (area != -1) pg->new_swap("/.swap", area, fs->swap_slots(area));
 	Printer* printer = new Printer("Printer", idt);
 	Keyboard* keyboard = new Keyboard("Keyboard", idt);
 	Device* disk_dummy = new Device("Disk", idt);
@@ -19,6 +21,8 @@ Kernel::Kernel(PR::Algorithm pa, MM::Algorithm ma, uint64_t uid) : uid(uid) {
 	devices.push_back(keyboard);
 	devices.push_back(disk_dummy);
 	clock = 0;
+	acc_last = MM::accesses.load(memory_order_relaxed);
+	acc_when = chrono::steady_clock::now();
 	exit_kernel = false;
 	mode = 1;
 }
@@ -78,6 +82,9 @@ void Kernel::run() {
 		}
 		sch->schedule(clock);
 		sch->set_serv();
+		pg->swap_flush(); // pages swapped out this tick
+		fs->aio_reap(); // file transfers finished since the last tick
+		fs->commit(); // group commit of this tick's metadata
 		if (mode == 2) {
 			if (header) {
 				cout << setw(12) << left << "pid";
@@ -91,9 +98,10 @@ void Kernel::run() {
 				cout << setw(12) << left << "eta";
 				cout << setw(12) << left << "nmapped";
 				cout << setw(12) << left << "nblocks";
-				cout << setw(12) << left << "pf rate(%)" << endl;
+				cout << setw(12) << left << "pf rate(%)";
+				cout << setw(12) << left << "tlb hit(%)" << endl;
 			}
-			cout << setfill('_') << setw(12 * 12) << "_" 
+			cout << setfill('_') << setw(12 * 13) << "_" 
 				 << setfill(' ') << endl;
 			sch->read_table();
 			header = false;
@@ -144,6 +152,18 @@ void Kernel::int_handler(int int_type, void* args) { // interrupt callback
 		pg->get(ss->pg, ss->buf);
 		break;
 	}
+	case INTN::INT::REQ_MEM_VIEW: {
+		struct ss {
+			int pg;
+			char* data;
+		}*ss = static_cast<struct ss*>(args);
+		ss->data = pg->frame_view(ss->pg);
+		break;
+	}
+	case INTN::INT::REQ_CLK_VIEW: {
+		*static_cast<const PR::Timepiece**>(args) = &clock;
+		break;
+	}
 	case INTN::INT::REQ_MEM_WRITE: {
 		struct ss {
 			int pg;
@@ -167,22 +187,24 @@ void Kernel::int_handler(int int_type, void* args) { // interrupt callback
 	}
 	case INTN::INT::PAGE_SWAP_OUT: {
 		struct ss {
-			string file;
+			int area;
 			char* buf;
 			int blk;
+			int n;
 			int state;
 		}*ss = static_cast<struct ss*>(args);
-		ss->state = fs->write_swapspace(ss->file, ss->buf, ss->blk);
+		ss->state = fs->swap_io(ss->area, ss->blk, ss->n, ss->buf, true);
 		break;
 	}
 	case INTN::INT::PAGE_SWAP_IN: {
 		struct ss {
-			string file;
+			int area;
 			char* buf;
 			int blk;
+			int n;
 			int state;
 		}*ss = static_cast<struct ss*>(args);
-		ss->state = fs->read_swapspace(ss->file, ss->buf, ss->blk);
+		ss->state = fs->swap_io(ss->area, ss->blk, ss->n, ss->buf, false);
 		break;
 	}
 	case INTN::INT::REQ_MEM_SWAP_IN_W: {
@@ -208,8 +230,9 @@ void Kernel::int_handler(int int_type, void* args) { // interrupt callback
 	case INTN::INT::REQ_MEM_SWAP_OUT: {
 		struct ss {
 			int pg;
+			const void* owner;
 		}*ss = static_cast<struct ss*>(args);
-		pg->pg_swap_out(ss->pg);
+		ss->pg = pg->pg_swap_out(ss->pg, ss->owner);
 		break;
 	}
 	case INTN::INT::DEVICE_REQ: {
@@ -303,7 +326,9 @@ void Kernel::int_handler(int int_type, void* args) { // interrupt callback
 int Kernel::load_prog(string path, VirtMemoryModel* mm, int* et, int* pri) {
 	*et = 0;
 	*pri = -1;
-	char* buf = new char[15 * FS::BLK_SIZE];
+	int64_t size = fs->file_size(path);
+	char* buf = new char[size > 0 ? size + 1 : 1];
+	buf[0] = 0;
 	char* buf_r = new char[MM::PAGE_SIZE];
 	char* buf_code = buf_r + 240;
 	char* p = buf_code;
@@ -448,6 +473,15 @@ vector<int> Kernel::mem_map() {
 	return pg->expose_mem_map();
 }
 
+// create and pin a swap file, then hand it to the pager
+bool Kernel::mkswap(string path, string name, int nslots) {
+	if (!fs->create_swapspace(path + "/", name, nslots)) return false;
+	int area = fs->swap_on(path + "/" + name);
+	if (area == -1) return false;
+	pg->new_swap(path + "/" + name, area, fs->swap_slots(area));
+	return true;
+}
+
 vector<int> Kernel::swap_map() {
 	return pg->expose_swap_map();
 }
@@ -464,6 +498,17 @@ double Kernel::statistic() {
 	return sch->statistic();
 }
 
+// memory accesses per host second since the last call
+double Kernel::access_rate() {
+	auto now = chrono::steady_clock::now();
+	double secs = chrono::duration<double>(now - acc_when).count();
+	uint64_t now_acc = MM::accesses.load(memory_order_relaxed);
+	double rate = secs > 0 ? (now_acc - acc_last) / secs : 0;
+	acc_last = now_acc;
+	acc_when = now;
+	return rate;
+}
+
 Kernel::~Kernel() {
 	delete pg;
 	delete fs;
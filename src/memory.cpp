@@ -1,5 +1,9 @@
 #include "../include/memory.h"
 
+namespace MM {
+	atomic<uint64_t> accesses(0);
+}
+
 PhysMemoryModel::PhysMemoryModel(int phys_mem_size) :
 	phys_mem_size(phys_mem_size) {
 	memory = new char[phys_mem_size];
@@ -31,148 +35,415 @@ bool PhysMemoryModel::dump(char* buf, MM::phys_addr from, uint32_t size) {
 	return true;
 }
 
-int PhysMemoryModel::swap_out(MM::phys_addr from, function<void(int, void*)> idt, int blk) {
-	struct {
-		string file;
-		char* buf;
-		int blk;
-		int state;
-	} args;
-	args.file = swapspace[(int)blk / 15];
-	args.buf = memory + from;
-	args.blk = blk % 15;
-	args.state = -1;
-	idt(INTN::INT::PAGE_SWAP_OUT, &args);
-	return args.state;
+// size bytes from from in place, nullptr when out of bound.
+// Valid as long as the model, nothing is copied
+char* PhysMemoryModel::peek(MM::phys_addr from, uint32_t size) {
+	if (from + static_cast<uint64_t>(size) > static_cast<uint64_t>(phys_mem_size)) {
+		Log::w("(memory.cpp) peek: out of bound.\n");
+		return nullptr;
+	}
+	return memory + from;
+}
+
+// area of a global slot, swapbase is ascending
+static int swap_area(const vector<int>& swapbase, int blk) {
+	return static_cast<int>(upper_bound(swapbase.begin(), swapbase.end(), blk) - swapbase.begin()) - 1;
 }
 
-int PhysMemoryModel::swap_in(MM::phys_addr from, function<void(int, void*)> idt, int blk) {
+// move n pages between buf and the slots from blk on, one
+// transfer per area the run crosses
+int PhysMemoryModel::swap_rw(char* buf, int blk, int n, bool wr, function<void(int, void*)> idt) {
 	struct {
-		string file;
+		int area;
 		char* buf;
 		int blk;
+		int n;
 		int state;
 	} args;
-	args.file = swapspace[(int)blk / 15];
-	args.buf = memory + from;
-	args.blk = blk % 15;
-	args.state = -1;
-	idt(INTN::INT::PAGE_SWAP_IN, &args);
-	return args.state;
-}
-
-bool PageMemoryModel::pg_swap_out(int pg) {
-	//cout << "swap out: " << pg << endl;
-	//if (pgtable[pg]->locked) return false;
-	/*if (freepgs.size() >= (pgtable.size() / 4)) {
-		pgtable[pg]->refed = 1;
-		pgtable[pg]->counter = 0;
+	while (n > 0) {
+		int a = swap_area(swapbase, blk);
+		int end = a + 1 < static_cast<int>(swapbase.size()) ? swapbase[a + 1] : INT_MAX;
+		args.area = swapdev[a];
+		args.buf = buf;
+		args.blk = blk - swapbase[a];
+		args.n = min(n, end - blk);
+		args.state = -1;
+		idt(wr ? INTN::INT::PAGE_SWAP_OUT : INTN::INT::PAGE_SWAP_IN, &args);
+		if (args.state) return args.state;
+		buf += args.n * MM::PAGE_SIZE;
+		blk += args.n;
+		n -= args.n;
+	}
+	return 0;
+}
+
+static uint32_t lz_hash(const char* p) {
+	uint32_t v = static_cast<unsigned char>(p[0]) << 16 | static_cast<unsigned char>(p[1]) << 8
+		| static_cast<unsigned char>(p[2]);
+	return (v * 2654435761u) >> 22;
+}
+
+// LZ77 with a one-entry hash of 3 byte prefixes. A control
+// byte below 0x80 is followed by that many + 1 literals, from
+// 0x80 on it is a match of (c & 0x7f) + 3 bytes at the 2 byte
+// little endian distance that follows. -1 when over cap
+static int lz_pack(const char* src, int n, char* dst, int cap) {
+	int head[1 << 10];
+	fill(head, head + (1 << 10), -1);
+	int o = 0, lit = 0, i = 0;
+	auto literals = [&](int end) {
+		while (lit > 0) {
+			int k = min(lit, 0x80);
+			if (o + 1 + k > cap) return false;
+			dst[o++] = static_cast<char>(k - 1);
+			memcpy(dst + o, src + end - lit, k);
+			o += k;
+			lit -= k;
+		}
 		return true;
-	}*/
-	int fs = -1;
-	for (int i = 0; i < swapbitmap.size(); i++) {
-		//cout << "in s " << i << endl;
-		if (swapbitmap[i] == 0) {
-			fs = i;
-			swapbitmap[i] = 1; 
-			break;
+	};
+	while (i < n) {
+		int from = -1, len = 0;
+		if (i + 3 <= n) {
+			uint32_t h = lz_hash(src + i);
+			from = head[h];
+			head[h] = i;
+			if (from != -1)
+				while (i + len < n && len < 0x7f + 3 && src[from + len] == src[i + len]) len++;
 		}
+		if (len < 3) {
+			lit++;
+			i++;
+			continue;
+		}
+		if (!literals(i) || o + 3 > cap) return -1;
+		dst[o++] = static_cast<char>(0x80 | (len - 3));
+		dst[o++] = static_cast<char>((i - from) & 0xff);
+		dst[o++] = static_cast<char>((i - from) >> 8);
+		for (int k = i + 1; k < i + len && k + 3 <= n; k++) head[lz_hash(src + k)] = k;
+		i += len;
 	}
-	//cout << "swapped to block: " << fs << endl;
-	if (fs == -1) {
-		Log::w("(memory.cpp) pg_swap_out: out of swapspace.\n");
-		return false;
+	if (!literals(n)) return -1;
+	return o;
+}
+
+static bool lz_unpack(const char* src, int len, char* dst, int n) {
+	int i = 0, o = 0;
+	while (i < len) {
+		int c = static_cast<unsigned char>(src[i++]);
+		if (c < 0x80) {
+			if (i + c + 1 > len || o + c + 1 > n) return false;
+			memcpy(dst + o, src + i, c + 1);
+			i += c + 1;
+			o += c + 1;
+			continue;
+		}
+		if (i + 2 > len) return false;
+		int k = (c & 0x7f) + 3;
+		int dist = static_cast<unsigned char>(src[i]) | static_cast<unsigned char>(src[i + 1]) << 8;
+		i += 2;
+		if (dist == 0 || dist > o || o + k > n) return false;
+		for (; k > 0; k--, o++) dst[o] = dst[o - dist]; // may overlap
 	}
-	struct Swap_info* ss = new struct Swap_info;
-	ss->page = pg;
-	ss->blk = fs;
-	ss->desc = pgtable[pg];
-	pgtable[pg] = new struct Page;
-	freepgs.push_back(pg);
-	swaptable.push_back(ss);
-	int res = swap_out(pg * MM::PAGE_SIZE, idt, fs);
-	return res == 0;
-}
-int PageMemoryModel::pg_swap_in(int pg) {
-	//cout << "swap in: " << pg << endl;
-	if (pgtable[pg]->refed && pgtable[pg]->counter == 0) {
-		pgtable[pg]->counter++;
-		return pg;
-	}
-	auto v = swaptable.begin();
-	int blk = -1;
-	for (; v != swaptable.end(); v++) {
-		if ((*v)->page == pg) {
-			blk = (*v)->blk; break;
+	return o == n;
+}
+
+static int cluster_size(int c, int nslots) {
+	return min(MM::SWAP_CLUSTER, nslots - c * MM::SWAP_CLUSTER);
+}
+
+// the rest of the current cluster first, then a wholly free
+// cluster, then any free slot
+int PageMemoryModel::alloc_slot() {
+	int slot = -1;
+	while (slot == -1 && clu_next < clu_end) {
+		if (swaptable[clu_next].page == -1) slot = clu_next;
+		clu_next++;
+	}
+	while (slot == -1 && !free_clusters.empty()) {
+		int c = free_clusters.back();
+		free_clusters.pop_back();
+		cluster_listed[c] = 0;
+		if (cluster_nfree[c] != cluster_size(c, swaptable.size())) continue;
+		slot = c * MM::SWAP_CLUSTER;
+		clu_next = slot + 1;
+		clu_end = slot + cluster_nfree[c];
+	}
+	while (slot == -1 && !freeslots.empty()) {
+		if (swaptable[freeslots.back()].page == -1) slot = freeslots.back();
+		freeslots.pop_back();
+	}
+	if (slot != -1) cluster_nfree[slot / MM::SWAP_CLUSTER]--;
+	return slot;
+}
+
+void PageMemoryModel::free_slot(int slot) {
+	swaptable[slot] = { -1, 0, 0, nullptr };
+	int c = slot / MM::SWAP_CLUSTER;
+	if (++cluster_nfree[c] == cluster_size(c, swaptable.size()) && !cluster_listed[c]) {
+		free_clusters.push_back(c);
+		cluster_listed[c] = 1;
+	}
+	freeslots.push_back(slot);
+	if (freeslots.size() > 2 * swaptable.size()) { // drop the stale entries
+		freeslots.clear();
+		for (int i = static_cast<int>(swaptable.size()) - 1; i >= 0; i--)
+			if (swaptable[i].page == -1) freeslots.push_back(i);
+	}
+}
+
+void PageMemoryModel::cache_put(int slot, char* data, bool dirty) {
+	while (swapcache.size() >= MM::SWAP_CACHE_PAGES) {
+		auto v = cache_order.begin();
+		while (v != cache_order.end() && swapcache[*v].dirty) v++;
+		if (v == cache_order.end()) { // all waiting to be written
+			swap_flush();
+			continue;
 		}
+		cache_drop(*v);
 	}
-	struct Page* p = new struct Page;
-	if (blk != -1) {
-		p = (*v)->desc;
-		swaptable.erase(v);
-		swapbitmap[blk] = 0;
+	cache_order.push_back(slot);
+	swapcache[slot] = { data, dirty, prev(cache_order.end()) };
+	if (dirty) swap_pending.push_back(slot);
+}
+
+void PageMemoryModel::cache_drop(int slot) {
+	auto v = swapcache.find(slot);
+	if (v == swapcache.end()) return;
+	if (v->second.dirty) // never written, and now never needs to be
+		swap_pending.erase(find(swap_pending.begin(), swap_pending.end(), slot));
+	delete[] v->second.data;
+	cache_order.erase(v->second.pos);
+	swapcache.erase(v);
+}
+
+// write every pending page, adjacent slots in one transfer
+void PageMemoryModel::swap_flush() {
+	sort(swap_pending.begin(), swap_pending.end());
+	vector<char> run;
+	int npending = static_cast<int>(swap_pending.size());
+	for (int i = 0; i < npending;) {
+		int j = i + 1;
+		while (j < npending && swap_pending[j] == swap_pending[j - 1] + 1) j++;
+		run.resize(static_cast<size_t>(j - i) * MM::PAGE_SIZE);
+		for (int k = i; k < j; k++) {
+			auto& c = swapcache[swap_pending[k]];
+			memcpy(&run[static_cast<size_t>(k - i) * MM::PAGE_SIZE], c.data, MM::PAGE_SIZE);
+			c.dirty = false;
+		}
+		if (swap_rw(run.data(), swap_pending[i], j - i, true, idt))
+			Log::w("(memory.cpp) swap_flush: swap write failed.\n");
+		swapstat.writes++;
+		i = j;
 	}
-	else {
-		Log::w("(memory.cpp) pg_swap_in: page loss.\n");
-		delete p;
+	swap_pending.clear();
+}
+
+// read the cluster around slot in one transfer, slot goes to
+// buf, the owner's other pages in it to the swap cache
+void PageMemoryModel::readaround(int slot, char* buf) {
+	const void* owner = swaptable[slot].owner;
+	int a = swap_area(swapbase, slot);
+	int lo = max(slot / MM::SWAP_CLUSTER * MM::SWAP_CLUSTER, swapbase[a]);
+	int nareas = static_cast<int>(swapbase.size());
+	int hi = min<int>(lo + MM::SWAP_CLUSTER, a + 1 < nareas ? swapbase[a + 1] : static_cast<int>(swaptable.size()));
+	auto wanted = [&](int s) {
+		return s == slot || (swaptable[s].page != -1 && swaptable[s].owner == owner
+			&& !swapcache.count(s) && !zpool.count(s));
+	};
+	while (!wanted(lo)) lo++;
+	while (!wanted(hi - 1)) hi--;
+	vector<char> run(static_cast<size_t>(hi - lo) * MM::PAGE_SIZE);
+	if (swap_rw(run.data(), lo, hi - lo, false, idt))
+		Log::w("(memory.cpp) readaround: swap read failed.\n");
+	swapstat.reads++;
+	memcpy(buf, &run[static_cast<size_t>(slot - lo) * MM::PAGE_SIZE], MM::PAGE_SIZE);
+	for (int s = lo; s < hi; s++) {
+		if (s == slot || !wanted(s)) continue;
+		char* data = new char[MM::PAGE_SIZE];
+		memcpy(data, &run[static_cast<size_t>(s - lo) * MM::PAGE_SIZE], MM::PAGE_SIZE);
+		cache_put(s, data, false);
+		swapstat.readaround++;
+	}
+}
+
+// false when the pool is off or page does not compress well
+bool PageMemoryModel::zpool_put(int slot, char* page) {
+	if (!zpool_limit) return false;
+	char packed[MM::ZSWAP_MAX_LEN];
+	int len = 1; // the fill byte
+	bool same = all_of(page, page + MM::PAGE_SIZE, [&](char c) { return c == page[0]; });
+	if (!same) len = lz_pack(page, MM::PAGE_SIZE, packed, MM::ZSWAP_MAX_LEN);
+	if (len == -1 || static_cast<uint32_t>(len) > zpool_limit) {
+		swapstat.z_rejected++;
 		return false;
 	}
+	if (zpool_used + len > zpool_limit) zpool_spill(len);
+	char* data = nullptr;
+	if (!same) {
+		data = new char[len];
+		memcpy(data, packed, len);
+	}
+	zpool_order.push_back(slot);
+	zpool[slot] = { data, static_cast<uint32_t>(len), page[0], prev(zpool_order.end()) };
+	zpool_used += len;
+	swapstat.z_stored++;
+	if (same) swapstat.z_same++;
+	swapstat.z_raw += MM::PAGE_SIZE;
+	swapstat.z_packed += len;
+	return true;
+}
+
+// false when slot is not in the pool
+bool PageMemoryModel::zpool_get(int slot, char* page) {
+	auto v = zpool.find(slot);
+	if (v == zpool.end()) return false;
+	if (!v->second.data) memset(page, v->second.fill, MM::PAGE_SIZE);
+	else if (!lz_unpack(v->second.data, v->second.len, page, MM::PAGE_SIZE))
+		Log::w("(memory.cpp) zpool_get: bad compressed page.\n");
+	return true;
+}
+
+void PageMemoryModel::zpool_drop(int slot) {
+	auto v = zpool.find(slot);
+	if (v == zpool.end()) return;
+	delete[] v->second.data;
+	zpool_used -= v->second.len;
+	zpool_order.erase(v->second.pos);
+	zpool.erase(v);
+}
+
+// move the oldest pages of the pool on to their slots until
+// len bytes more fit, at least SWAP_CLUSTER of them so they
+// are written together
+void PageMemoryModel::zpool_spill(uint32_t len) {
+	for (int n = 0; !zpool_order.empty() && (n < MM::SWAP_CLUSTER || zpool_used + len > zpool_limit); n++) {
+		int slot = zpool_order.front();
+		char* data = new char[MM::PAGE_SIZE];
+		zpool_get(slot, data);
+		zpool_drop(slot);
+		cache_put(slot, data, true);
+		swapstat.z_spilled++;
+	}
+}
+
+// pool_bytes of compressed pages before the swap area, 0 for
+// none
+void PageMemoryModel::set_zswap(uint32_t pool_bytes) {
+	zpool_limit = pool_bytes;
+	if (zpool_used > zpool_limit) zpool_spill(0);
+	if (swap_pending.size() >= MM::SWAP_CLUSTER) swap_flush();
+}
+
+// the slot now holding pg, -1 when swap is full. The slot
+// stands in for the page in the owner's page table
+int PageMemoryModel::pg_swap_out(int pg, const void* owner) {
+	int slot = alloc_slot();
+	if (slot == -1) {
+		Log::w("(memory.cpp) pg_swap_out: out of swapspace.\n");
+		return -1;
+	}
+	swaptable[slot] = { pg, pgflags[pg], pgcount[pg], owner };
+	char page[MM::PAGE_SIZE];
+	dump(page, pg * MM::PAGE_SIZE, MM::PAGE_SIZE);
+	if (!zpool_put(slot, page)) {
+		char* data = new char[MM::PAGE_SIZE];
+		memcpy(data, page, MM::PAGE_SIZE);
+		cache_put(slot, data, true);
+	}
+	pgflags[pg] = 0;
+	pgcount[pg] = 0;
+	freepgs.push_back(pg);
+	swapstat.pages_out++;
+	if (swap_pending.size() >= MM::SWAP_CLUSTER) swap_flush();
+	return slot;
+}
+
+int PageMemoryModel::pg_swap_in(int slot) {
+	if (slot < 0 || slot >= static_cast<int>(swaptable.size()) || swaptable[slot].page == -1) {
+		Log::w("(memory.cpp) pg_swap_in: page loss.\n");
+		return -1;
+	}
 	int new_page = alloc_page();
-	delete pgtable[new_page];
-	pgtable[new_page] = p;
-	swap_in(new_page * MM::PAGE_SIZE, idt, blk);
+	pgflags[new_page] = swaptable[slot].flags;
+	pgcount[new_page] = swaptable[slot].counter;
+	char buf[MM::PAGE_SIZE];
+	auto v = swapcache.find(slot);
+	if (zpool_get(slot, buf)) {
+		load(buf, new_page * MM::PAGE_SIZE, MM::PAGE_SIZE);
+		swapstat.z_hits++;
+	}
+	else if (v != swapcache.end()) {
+		load(v->second.data, new_page * MM::PAGE_SIZE, MM::PAGE_SIZE);
+		swapstat.cache_hits++;
+	}
+	else {
+		readaround(slot, buf);
+		load(buf, new_page * MM::PAGE_SIZE, MM::PAGE_SIZE);
+	}
+	zpool_drop(slot);
+	cache_drop(slot);
+	free_slot(slot);
+	swapstat.pages_in++;
 	return new_page;
 }
 
 PageMemoryModel::PageMemoryModel(function<void(int, void*)> idt, int phys_mem_size, int pg_size)
 	: PhysMemoryModel(phys_mem_size), pg_size(pg_size), idt(idt) {
 	npgs = static_cast<int>(floor(phys_mem_size / pg_size));
-	pgtable.resize(npgs);
-	for (auto i = pgtable.begin(); i != pgtable.end(); i++) {
-		struct Page* p = new struct Page;
-		*i = p;
-	}
-	for (int i = 0; i < pgtable.size(); i++) {
+	pgflags.resize(npgs, 0);
+	pgcount.resize(npgs, 0);
+	for (int i = 0; i < npgs; i++) {
 		freepgs.push_back(i);
 	}
-	swapbitmap.resize(15);
-	for (auto v = swapbitmap.begin(); v != swapbitmap.end(); v++) {
-		*v = 0;
-	}
+	clu_next = 0;
+	clu_end = 0;
+	zpool_used = 0;
+	zpool_limit = 0;
+	memset(&swapstat, 0, sizeof(MM::SwapStat));
 }
 PageMemoryModel::~PageMemoryModel() {
-	for (auto v : pgtable) {
-		if(v) delete v;
-	}
+	for (auto& v : swapcache) delete[] v.second.data;
+	for (auto& v : zpool) delete[] v.second.data;
 }
 
-void PageMemoryModel::release_swap(int pg) {
-	if (pgtable[pg]->refed && pgtable[pg]->counter == 0) {
-		free_page(pg);
-	}
-	auto v = swaptable.begin();
-	for (; v != swaptable.end(); v++) {
-		if ((*v)->page == pg) {
-			swapbitmap[(*v)->blk] = 0; break;
-			delete (*v);
-		}
-	}
-	swaptable.erase(v);
+// add nslots slots of filesystem swap area area
+void PageMemoryModel::new_swap(string path, int area, int nslots) {
+	int base = static_cast<int>(swaptable.size());
+	reg_swap(path, area, base);
+	swaptable.resize(base + nslots, { -1, 0, 0, nullptr });
+	int nclusters = (base + nslots + MM::SWAP_CLUSTER - 1) / MM::SWAP_CLUSTER;
+	cluster_nfree.resize(nclusters, 0);
+	cluster_listed.resize(nclusters, 0);
+	// lower slots are handed out first
+	for (int i = base + nslots - 1; i >= base; i--) free_slot(i);
+}
+
+void PageMemoryModel::release_swap(int slot) {
+	if (slot < 0 || slot >= static_cast<int>(swaptable.size()) || swaptable[slot].page == -1) return;
+	zpool_drop(slot);
+	cache_drop(slot);
+	free_slot(slot);
+}
+
+MM::SwapStat PageMemoryModel::swap_stat() {
+	swapstat.z_used = zpool_used;
+	swapstat.z_limit = zpool_limit;
+	return swapstat;
 }
 
 int PageMemoryModel::alloc_page() {
 	lock_guard<mutex> guard(pg_lock);
 	if (freepgs.empty()) {
 		int spg = -1;
-		for (int i = 0; i < pgtable.size(); i++) {
-			auto pg = pgtable[i];
-			if (pg->refed && !pg->counter) {
+		for (int i = 0; i < npgs; i++) {
+			if ((pgflags[i] & MM::PG_REFED) && !pgcount[i]) {
 				spg = i;
 				break;
 			}
 		}
 		if (spg != -1) {
-			pg_swap_out(spg);
+			pg_swap_out(spg, nullptr);
 		}
 		else {
 			//process swapout
@@ -181,18 +452,18 @@ int PageMemoryModel::alloc_page() {
 	}
 	int pg = freepgs.front();
 	freepgs.pop_front();
-	pgtable[pg]->counter++;
+	pgcount[pg]++;
 	return pg;
 }
 
 int PageMemoryModel::free_page(int pg) {
 	lock_guard<mutex> guard(pg_lock);
-	if (pgtable[pg]->locked) {
+	if (pgflags[pg] & MM::PG_LOCKED) {
 		return 1;
 	}
-	pgtable[pg]->refed = 0;
-	pgtable[pg]->counter = 0;
-	if (pgtable[pg]->dirty) {
+	pgflags[pg] &= ~MM::PG_REFED;
+	pgcount[pg] = 0;
+	if (pgflags[pg] & MM::PG_DIRTY) {
 		// writeback????
 	}
 	freepgs.push_back(pg);
@@ -203,18 +474,24 @@ void PageMemoryModel::get(int pg, char* buf) {
 	dump(buf, pg * MM::PAGE_SIZE, MM::PAGE_SIZE);
 }
 
+// the page in physical memory, nullptr for a bad pg
+char* PageMemoryModel::frame_view(int pg) {
+	if (pg < 0 || pg >= npgs) return nullptr;
+	return peek(pg * MM::PAGE_SIZE, MM::PAGE_SIZE);
+}
+
 void PageMemoryModel::stat() {
 	cout << setfill('_') << setw(12 * 8 - 6) << "_" << endl << setfill(' ');
 	for (int i = 0; i < npgs; i++) {
-		auto pg = pgtable[i];
 		cout << setw(6) << left << i;
-		cout << setw(6) << left << pg->counter;
+		cout << setw(6) << left << pgcount[i];
 		if ((i + 1) % 8 == 0) cout << endl;
 	}
 	cout << endl << setfill('_') << setw(12 * 8 - 6) << "_" << endl << setfill(' ');
 	cout << "Swap:" << endl;
-	for (auto a : swaptable) {
-		cout << a->page << "->" << a->blk << endl;
+	int nslots = static_cast<int>(swaptable.size());
+	for (int i = 0; i < nslots; i++) {
+		if (swaptable[i].page != -1) cout << swaptable[i].page << "->" << i << endl;
 	}
 	cout << setfill('_') << setw(12 * 8 - 6) << "_" << endl << setfill(' ');
 }
@@ -224,91 +501,128 @@ bool PageMemoryModel::put(int pg, char* buf, int offset, int size) {
 	//cout << pg << endl;
 	//Log::i("*** visited pg = %d\n", pg);
 	if (pg == -1) return false;
-	if (pgtable[pg]->locked) {
+	if (pgflags[pg] & MM::PG_LOCKED) {
 		return false;
 	}
 	load(buf, pg * MM::PAGE_SIZE + offset, size);
-	pgtable[pg]->dirty = 1;
+	pgflags[pg] |= MM::PG_DIRTY;
 	return true;
 }
 
 
 vector<int> PageMemoryModel::expose_mem_map() {
-	vector<int> res;
-	for (auto v : pgtable) {
-		if (v) {
-			res.push_back(v->counter);
-		}
-		else {
-			res.push_back(0);
-		}
-	}
-	return res;
+	return pgcount;
 }
 
 vector<int> PageMemoryModel::expose_swap_map() {
-	vector<int> res(swapbitmap.size(), -1);
-	for (auto v: swaptable) {
-		res[v->blk] = v->page;
+	int nslots = static_cast<int>(swaptable.size());
+	vector<int> res(nslots, -1);
+	for (int i = 0; i < nslots; i++) {
+		res[i] = swaptable[i].page;
 	}
 	return res;
 }
 
-VirtMemoryModel::VirtMemoryModel(function<void(int, void*)> idt, MM::Algorithm algo) 
-	: idt(idt), algo(algo) {
-	pgtable.resize(MM::VIRT_MEM_SIZE / MM::PAGE_SIZE);
-	for (auto i = pgtable.begin(); i != pgtable.end(); i++) {
-		struct VPage* p = new struct VPage;
-		*i = p;
+static int pt_index(uint32_t vpg, int level) {
+	return (vpg >> (MM::PT_BITS * (MM::PT_LEVELS - 1 - level))) & ((1 << MM::PT_BITS) - 1);
+}
+
+// the entry of vpg, -1 when no leaf covers it
+int PageTable::find(uint32_t vpg) {
+	if (vpg >> MM::VPN_BITS) return -1;
+	uint32_t n = 0;
+	for (int l = 0; l < MM::PT_LEVELS - 2; l++) {
+		n = nodes[n].next[pt_index(vpg, l)];
+		if (!n) return -1;
+	}
+	uint32_t leaf = nodes[n].next[pt_index(vpg, MM::PT_LEVELS - 2)];
+	if (!leaf) return -1;
+	return static_cast<int>((leaf - 1) << MM::PT_BITS) | pt_index(vpg, MM::PT_LEVELS - 1);
+}
+
+// the entry of vpg, made with the nodes above it if needed
+int PageTable::get(uint32_t vpg) {
+	if (vpg >> MM::VPN_BITS) return -1;
+	uint32_t n = 0;
+	for (int l = 0; l < MM::PT_LEVELS - 2; l++) {
+		int i = pt_index(vpg, l);
+		if (!nodes[n].next[i]) {
+			nodes.push_back(Node());
+			nodes[n].next[i] = static_cast<uint32_t>(nodes.size() - 1);
+		}
+		n = nodes[n].next[i];
+	}
+	int i = pt_index(vpg, MM::PT_LEVELS - 2);
+	if (!nodes[n].next[i]) {
+		leaves.push_back(Leaf());
+		nodes[n].next[i] = static_cast<uint32_t>(leaves.size());
 	}
+	return static_cast<int>((nodes[n].next[i] - 1) << MM::PT_BITS) | pt_index(vpg, MM::PT_LEVELS - 1);
+}
+
+// every entry with a flag set, leaf by leaf
+void PageTable::for_each(const function<void(int)>& f) {
+	for (size_t l = 0; l < leaves.size(); l++)
+		for (int i = 0; i < (1 << MM::PT_BITS); i++)
+			if (leaves[l].flags[i]) f(static_cast<int>(l << MM::PT_BITS) | i);
+}
+
+size_t PageTable::bytes() {
+	return nodes.size() * sizeof(Node) + leaves.size() * sizeof(Leaf);
+}
+
+VirtMemoryModel::VirtMemoryModel(function<void(int, void*)> idt, MM::Algorithm algo) 
+	: idt(idt), algo(algo), algo_req(MM::Algorithm::NONE) {
 	nmapped = 0;
 	nblocks = 0;
 	acc_cnt = 0;
 	repl_cnt = 0;
+	tlb_hits = 0;
+	tlb_misses = 0;
+	clock = nullptr;
+	set_blocks(0);
 }
 
 VirtMemoryModel::VirtMemoryModel(VirtMemoryModel* v)
-{
-	pgtable.resize(MM::VIRT_MEM_SIZE / MM::PAGE_SIZE);
-	for (int i = 0; i < pgtable.size(); i++) {
-		struct VPage* p = new struct VPage(v->pgtable[i]);
-		pgtable[i] = p;
-	}
+	: pgtable(v->pgtable), idt(v->idt), algo(v->algo), algo_req(v->algo_req.load()) {
 	nmapped = v->nmapped;
-	set_blocks(v->nblocks);
-	idt = v->idt;
-	algo = v->algo;
+	set_blocks(v->nblocks); // policy_reset reads algo
 	acc_cnt = 0;
 	repl_cnt = 0;
+	tlb_hits = 0;
+	tlb_misses = 0;
+	clock = nullptr;
+	tlb_flush(-1);
 }
 
 VirtMemoryModel::~VirtMemoryModel() {
-	for (auto v : pgtable) {
-		if (v && v->refed) {
-			if (!v->present)
-				idt(INTN::INT::RELEASE_SWAP, &v->addr);
+	pgtable.for_each([this](int pte) {
+		if (pgtable.flags(pte) & MM::VP_REFED) {
+			if (!(pgtable.flags(pte) & MM::VP_PRESENT))
+				idt(INTN::INT::RELEASE_SWAP, &pgtable.addr(pte));
 			else
-				idt(INTN::INT::RELEASE_PAGE, &v->addr);
+				idt(INTN::INT::RELEASE_PAGE, &pgtable.addr(pte));
 		}
-		if (v) delete v;
-	}
+	});
 }
 
 bool VirtMemoryModel::access_page(int pg, char* buf) {
-	if (!pgtable[pg]->refed) { // seg fault;
+	int pte = pgtable.find(pg);
+	if (pte == -1 || !(pgtable.flags(pte) & MM::VP_REFED)) { // seg fault;
 		return false;
 	}
 	int clk = -1;
 	idt(INTN::INT::REQ_CLK, &clk);
-	if (pgtable[pg]->present) { // in frame, in memory
+	if (pgtable.flags(pte) & MM::VP_PRESENT) { // in frame, in memory
 		struct args {
 			int pg;
 			char* buf;
 		} args;
-		args.pg = pgtable[pg]->addr;
+		args.pg = pgtable.addr(pte);
 		args.buf = buf;
 		idt(INTN::INT::REQ_MEM_ACC, &args);
-		pgtable[pg]->t_ref = clk;
+		int f = pgtable.frame(pte) - 1;
+		if (f != -1) touch(f, clk);
 		return true;
 	}
 	else { // not in frame
@@ -316,42 +630,42 @@ bool VirtMemoryModel::access_page(int pg, char* buf) {
 			int pg;
 			char* buf;
 		} args;
-		args.pg = pgtable[pg]->addr;
+		args.pg = pgtable.addr(pte);
 		args.buf = buf;
 		idt(INTN::INT::REQ_MEM_SWAP_IN_R, &args);
-		pgtable[pg]->addr = args.pg;
-		pgtable[pg]->t_in = clk;
-		pgtable[pg]->t_ref = clk;
-		int f = alloc_frame();
-		frame[f] = pg;
+		pgtable.addr(pte) = args.pg;
+		pgtable.flags(pte) |= MM::VP_PRESENT;
+		alloc_frame(pg, pte, clk);
 		return true;
 	}
 	return false;
 }
 
 bool VirtMemoryModel::access(MM::virt_addr addr, char* buf) {
-	if (addr > MM::VIRT_MEM_SIZE) {
-		// segmentation fault
-		return false;
-	}
 	auto offset = addr % MM::PAGE_SIZE;
 	auto pg = addr / MM::PAGE_SIZE;
 	//cout << "mem read: " << pg << endl;
-	char* vpbuf = new char[MM::PAGE_SIZE];
+	if(pg > 0) acc_cnt++;
+	MM::accesses.fetch_add(1, memory_order_relaxed);
+	auto e = tlb_lookup(pg);
+	if (!e) {
+		int pte = pgtable.find(pg);
+		if (pte != -1 && (pgtable.flags(pte) & MM::VP_PRESENT)) e = tlb_fill(pg, pte);
+	}
+	if (e) { // read the frame in place
+		touch(e->frame, *clock);
+		*buf = e->data[offset];
+		return true;
+	}
+	char vpbuf[MM::PAGE_SIZE];
 	bool nfault = access_page(pg, vpbuf);
 	if (nfault) {
-		memcpy(buf, vpbuf + offset, 1);
+		*buf = vpbuf[offset];
 	}
-	delete[] vpbuf;
-	if(pg > 0) acc_cnt++;
 	return nfault;
 }
 
 bool VirtMemoryModel::view(MM::virt_addr from, MM::virt_addr to, char* buf) {
-	if (max(from, to) > MM::VIRT_MEM_SIZE) {
-		// segmentation fault
-		return false;
-	}
 	auto pgfrom = from / MM::PAGE_SIZE;
 	auto pgto = to / MM::PAGE_SIZE;
 	if (pgfrom != pgto) {
@@ -367,62 +681,264 @@ bool VirtMemoryModel::view(MM::virt_addr from, MM::virt_addr to, char* buf) {
 	return nfault;
 }
 
+// the entry of pg when cached, nullptr otherwise
+struct TLB_entry* VirtMemoryModel::tlb_lookup(int pg) {
+	auto& e = tlb[pg % MM::TLB_ENTRIES];
+	if (e.vpg == pg) {
+		tlb_hits++;
+		return &e;
+	}
+	tlb_misses++;
+	return nullptr;
+}
+
+// cache the frame of present page pg, nullptr when it has no
+// frame or the kernel gives no view
+struct TLB_entry* VirtMemoryModel::tlb_fill(int pg, int pte) {
+	int f = pgtable.frame(pte) - 1;
+	if (f == -1) return nullptr;
+	if (!clock) idt(INTN::INT::REQ_CLK_VIEW, &clock);
+	struct {
+		int pg;
+		char* data;
+	} args;
+	args.pg = pgtable.addr(pte);
+	args.data = nullptr;
+	idt(INTN::INT::REQ_MEM_VIEW, &args);
+	if (!args.data || !clock) return nullptr;
+	auto& e = tlb[pg % MM::TLB_ENTRIES];
+	e = { pg, pte, f, args.data };
+	return &e;
+}
+
+// drop the entry of pg, every entry for -1
+void VirtMemoryModel::tlb_flush(int pg) {
+	for (auto& e : tlb)
+		if (pg == -1 || e.vpg == pg) e = { -1, -1, -1, nullptr };
+}
+
+// the occupied frame with the smallest stamp. Two plain passes
+// over the stamps, no branch to keep the compiler from
+// vectorizing the first
+int VirtMemoryModel::oldest(const vector<int>& stamp) {
+	int mtime = INT_MAX;
+	for (int i = 0; i < nblocks; i++)
+		mtime = min(mtime, frame[i] != -1 ? stamp[i] : INT_MAX);
+	for (int i = 0; i < nblocks; i++)
+		if (frame[i] != -1 && stamp[i] == mtime) return i;
+	return -1;
+}
+
+// put frame f at the head of list l
+void VirtMemoryModel::fl_push(int l, int f) {
+	fl_of[f] = l;
+	fl_prev[f] = -1;
+	fl_next[f] = fl_head[l];
+	if (fl_head[l] != -1) fl_prev[fl_head[l]] = f;
+	else fl_tail[l] = f;
+	fl_head[l] = f;
+	fl_size[l]++;
+}
+
+void VirtMemoryModel::fl_remove(int f) {
+	int l = fl_of[f];
+	if (l == -1) return;
+	if (fl_prev[f] != -1) fl_next[fl_prev[f]] = fl_next[f];
+	else fl_head[l] = fl_next[f];
+	if (fl_next[f] != -1) fl_prev[fl_next[f]] = fl_prev[f];
+	else fl_tail[l] = fl_prev[f];
+	fl_of[f] = -1;
+	fl_size[l]--;
+}
+
+void VirtMemoryModel::ghost_push(int l, int pg) {
+	ghost_remove(pg);
+	ghost[l].push_front(pg);
+	ghost_pos[pg] = { l, ghost[l].begin() };
+}
+
+// forget the oldest page of ghost list l
+void VirtMemoryModel::ghost_pop(int l) {
+	if (ghost[l].empty()) return;
+	ghost_pos.erase(ghost[l].back());
+	ghost[l].pop_back();
+}
+
+// the ghost list holding pg, -1 when none
+int VirtMemoryModel::ghost_find(int pg) {
+	auto it = ghost_pos.find(pg);
+	return it == ghost_pos.end() ? -1 : it->second.first;
+}
+
+void VirtMemoryModel::ghost_remove(int pg) {
+	auto it = ghost_pos.find(pg);
+	if (it == ghost_pos.end()) return;
+	ghost[it->second.first].erase(it->second.second);
+	ghost_pos.erase(it);
+}
+
+// frame f was referenced at clk
+void VirtMemoryModel::touch(int f, int clk) {
+	policy_sync();
+	frame_t_ref[f] = clk;
+	frame_ref[f] = 1;
+	if (fl_of[f] == -1 || fl_head[1] == f) return;
+	if (algo == MM::Algorithm::ARC || (algo == MM::Algorithm::TWO_Q && fl_of[f] == 1)) {
+		fl_remove(f);
+		fl_push(1, f);
+	}
+}
+
+// page pg just came into frame f
+void VirtMemoryModel::admit(int f, int pg) {
+	frame_ref[f] = 1;
+	if (algo != MM::Algorithm::TWO_Q && algo != MM::Algorithm::ARC) return;
+	if (ghost_find(pg) != -1) { // seen lately, it is a frequent one
+		ghost_remove(pg);
+		fl_push(1, f);
+		return;
+	}
+	if (algo == MM::Algorithm::ARC) {
+		// remember at most nblocks pages of recency, 2 * nblocks in all
+		if (fl_size[0] + (int)ghost[0].size() >= nblocks)
+			ghost_pop(0);
+		else if (fl_size[0] + fl_size[1] + (int)(ghost[0].size() + ghost[1].size()) >= 2 * nblocks)
+			ghost_pop(1);
+	}
+	fl_push(0, f);
+}
+
+// swap out the page in frame f
+void VirtMemoryModel::evict(int f) {
+	int pte = pgtable.find(frame[f]);
+	pgtable.flags(pte) &= ~MM::VP_PRESENT;
+	struct args {
+		int pg;
+		const void* owner;
+	} args;
+	args.pg = pgtable.addr(pte);
+	args.owner = this;
+	idt(INTN::INT::REQ_MEM_SWAP_OUT, &args);
+	tlb_flush(frame[f]); // the frame is gone
+	pgtable.addr(pte) = args.pg; // the swap slot until swapped in
+	pgtable.frame(pte) = 0;
+	fl_remove(f);
+	frame[f] = -1;
+	nmapped--;
+}
+
+// start the policy over, the frames in use taken as new
+// ones in the order they came in
+void VirtMemoryModel::policy_reset() {
+	fl_prev.assign(nblocks, -1);
+	fl_next.assign(nblocks, -1);
+	fl_of.assign(nblocks, -1);
+	frame_ref.assign(nblocks, 1);
+	for (int l = 0; l < 2; l++) {
+		fl_head[l] = fl_tail[l] = -1;
+		fl_size[l] = 0;
+		ghost[l].clear();
+	}
+	ghost_pos.clear();
+	arc_p = 0;
+	hand = 0;
+	if (algo != MM::Algorithm::TWO_Q && algo != MM::Algorithm::ARC) return;
+	vector<int> in;
+	for (int i = 0; i < nblocks; i++)
+		if (frame[i] != -1) in.push_back(i);
+	sort(in.begin(), in.end(), [this](int a, int b) { return frame_t_in[a] < frame_t_in[b]; });
+	for (int f : in) fl_push(0, f);
+}
+
 void VirtMemoryModel::set_blocks(int blks) {
+	tlb_flush(-1);
+	blks = min(blks, 0xffff); // the page table keeps frame + 1 in 16 bits
+	pgtable.for_each([this](int pte) { pgtable.frame(pte) = 0; });
 	nblocks = blks;
-	frame.resize(blks);
-	for (int i = 0; i < blks; i++) {
-		frame[i] = -1;
-	}
+	frame.assign(blks, -1);
+	frame_t_in.assign(blks, -1);
+	frame_t_ref.assign(blks, -1);
+	policy_reset();
 }
 
-void VirtMemoryModel::replace() {
-	if (algo == MM::Algorithm::FIFO) {
-		int fout = -1;
-		int mtime = INT_MAX;
-		for (int i = 0; i < nblocks; i++) {
-			if (frame[i] && pgtable[frame[i]]->t_in < mtime) {
-				fout = i;
-				mtime = pgtable[frame[i]]->t_in;
-			}
+// make room for page pg
+void VirtMemoryModel::replace(int pg) {
+	int fout = -1;
+	int to = -1; // ghost list to remember the victim in
+	if (nblocks == 0) return;
+	switch (algo) {
+	case MM::Algorithm::FIFO:
+		fout = oldest(frame_t_in);
+		break;
+	case MM::Algorithm::LRU:
+		fout = oldest(frame_t_ref);
+		break;
+	case MM::Algorithm::CLOCK:
+		// a second sweep finds every bit cleared
+		for (int i = 0; i <= 2 * nblocks && fout == -1; i++, hand = (hand + 1) % nblocks) {
+			if (frame[hand] == -1) continue;
+			if (frame_ref[hand]) frame_ref[hand] = 0;
+			else fout = hand;
 		}
-		pgtable[frame[fout]]->present = 0;
-		struct args {
-			int pg;
-		} args;
-		args.pg = pgtable[frame[fout]]->addr;
-		idt(INTN::INT::REQ_MEM_SWAP_OUT, &args);
-		frame[fout] = -1;
-		nmapped--;
-	}
-	else if (algo == MM::Algorithm::LRU) {
-		int fout = -1;
-		int mtime = INT_MAX;
-		for (int i = 0; i < nblocks; i++) {
-			if (frame[i] && pgtable[frame[i]]->t_ref < mtime) {
-				fout = i;
-				mtime = pgtable[frame[i]]->t_ref;
-			}
+		break;
+	case MM::Algorithm::TWO_Q:
+		if (fl_size[0] > max(1, nblocks / 4) || fl_size[1] == 0) {
+			fout = fl_tail[0];
+			to = 0;
 		}
-		pgtable[frame[fout]]->present = 0;
-		struct args {
-			int pg;
-		} args;
-		args.pg = pgtable[frame[fout]]->addr;
-		idt(INTN::INT::REQ_MEM_SWAP_OUT, &args);
-		frame[fout] = -1;
-		nmapped--;
+		else {
+			fout = fl_tail[1];
+		}
+		break;
+	case MM::Algorithm::ARC: {
+		int g = ghost_find(pg);
+		if (g == -1 && fl_size[0] == nblocks) {
+			fout = fl_tail[0]; // all recency, no room to remember it
+		}
+		else if (fl_size[1] == 0 || (fl_size[0] > 0 && (fl_size[0] > arc_p || (g == 1 && fl_size[0] == arc_p)))) {
+			fout = fl_tail[0];
+			to = 0;
+		}
+		else {
+			fout = fl_tail[1];
+			to = 1;
+		}
+		break;
 	}
-	else {
+	default:
 		// should not happen
+		return;
 	}
+	if (fout == -1) fout = oldest(frame_t_in); // frames the policy never saw
+	if (fout == -1) return;
+	int out = frame[fout];
+	evict(fout);
+	if (to != -1) ghost_push(to, out);
+	if (algo == MM::Algorithm::TWO_Q)
+		while ((int)ghost[0].size() > max(1, nblocks / 2)) ghost_pop(0);
 }
 
-int VirtMemoryModel::alloc_frame() {
-	if (nmapped == nblocks) replace();
+// a frame for page pg, entry pte, at clk, another page is
+// swapped out when all are taken
+int VirtMemoryModel::alloc_frame(int pg, int pte, int clk) {
+	policy_sync();
+	if (algo == MM::Algorithm::ARC) { // move the target towards the list that missed pg
+		int g = ghost_find(pg);
+		if (g == 0)
+			arc_p = min(nblocks, arc_p + max(1, (int)(ghost[1].size() / ghost[0].size())));
+		else if (g == 1)
+			arc_p = max(0, arc_p - max(1, (int)(ghost[0].size() / ghost[1].size())));
+	}
+	if (nmapped == nblocks) replace(pg);
 	for (int i = 0; i < frame.size(); i++) {
 		if (frame[i] == -1) {
 			repl_cnt++;
 			nmapped++;
+			frame[i] = pg;
+			frame_t_in[i] = clk;
+			frame_t_ref[i] = clk;
+			pgtable.frame(pte) = static_cast<uint16_t>(i + 1);
+			admit(i, pg);
 			return i;
 		}
 	}
@@ -430,43 +946,49 @@ int VirtMemoryModel::alloc_frame() {
 }
 
 bool VirtMemoryModel::write_page(int pg, char* buf, MM::log_addr addr, int size) {
+	auto e = tlb_lookup(pg);
+	int pte = e ? e->pte : pgtable.get(pg);
+	if (pte == -1) return false;
+	if (!e && (pgtable.flags(pte) & MM::VP_PRESENT)) e = tlb_fill(pg, pte);
+	if (e) { // write the frame in place
+		if (size > 0) memcpy(e->data + addr, buf, size);
+		pgtable.flags(pte) |= MM::VP_DIRTY;
+		touch(e->frame, *clock);
+		return true;
+	}
 	int clk = -1;
 	idt(INTN::INT::REQ_CLK, &clk);
-	if (!pgtable[pg]->refed) { // not in frame, not in memory, not in swap
+	if (!(pgtable.flags(pte) & MM::VP_REFED)) { // not in frame, not in memory, not in swap
 		struct args {
 			int pg;
 			char* buf;
 			int addr;
 			int size;
 		} args;
-		args.pg = pgtable[pg]->addr;
+		args.pg = -1;
 		args.buf = buf;
 		args.addr = addr;
 		args.size = size;
 		idt(INTN::INT::PAGE_FAULT, &args);
-		pgtable[pg]->refed = 1;
-		pgtable[pg]->addr = args.pg;
-		pgtable[pg]->dirty = 1;
-		pgtable[pg]->present = 1;
-		pgtable[pg]->t_in = clk;
-		pgtable[pg]->t_ref = clk;
-		int f = alloc_frame();
-		frame[f] = pg;
+		pgtable.flags(pte) |= MM::VP_REFED | MM::VP_DIRTY | MM::VP_PRESENT;
+		pgtable.addr(pte) = args.pg;
+		alloc_frame(pg, pte, clk);
 		return true;
 	}
-	if (pgtable[pg]->present) { // in frame and in memory
+	if (pgtable.flags(pte) & MM::VP_PRESENT) { // in frame and in memory
 		struct args {
 			int pg;
 			char* buf;
 			int addr;
 			int size;
 		} args;
-		args.pg = pgtable[pg]->addr;
+		args.pg = pgtable.addr(pte);
 		args.buf = buf;
 		args.addr = addr;
 		args.size = size;
-		pgtable[pg]->dirty = 1;
-		pgtable[pg]->t_ref = clk;
+		pgtable.flags(pte) |= MM::VP_DIRTY;
+		int f = pgtable.frame(pte) - 1;
+		if (f != -1) touch(f, clk);
 		idt(INTN::INT::REQ_MEM_WRITE, &args);
 		return true;
 	}
@@ -477,27 +999,20 @@ bool VirtMemoryModel::write_page(int pg, char* buf, MM::log_addr addr, int size)
 			int addr;
 			int size;
 		} args;
-		args.pg = pgtable[pg]->addr;
+		args.pg = pgtable.addr(pte);
 		args.buf = buf;
 		args.addr = addr;
 		args.size = size;
 		idt(INTN::INT::REQ_MEM_SWAP_IN_W, &args);
-		pgtable[pg]->addr = args.pg;
-		pgtable[pg]->present = 1;
-		pgtable[pg]->t_in = clk;
-		pgtable[pg]->t_ref = clk;
-		int f = alloc_frame();
-		frame[f] = pg;
+		pgtable.addr(pte) = args.pg;
+		pgtable.flags(pte) |= MM::VP_PRESENT;
+		alloc_frame(pg, pte, clk);
 		return true;
 	}
 	return false;
 }
 
 bool VirtMemoryModel::write(MM::virt_addr addr, char* buf, int size) {
-	if (addr > MM::VIRT_MEM_SIZE) {
-		// segmentation fault
-		return false;
-	}
 	bool nfault = true;
 	auto offset = addr % MM::PAGE_SIZE;
 	auto pg = addr / MM::PAGE_SIZE;
@@ -521,13 +1036,13 @@ void VirtMemoryModel::stat(int pid, string name) {
 		cout << setw(6) << left << pid;
 		cout << setw(12) << left << name;
 		if (frame[i] != -1) {
-			auto entry = pgtable[frame[i]];
-			cout << setw(12) << left << entry->refed;
-			cout << setw(12) << left << entry->present;
-			cout << setw(12) << left << entry->t_in;
-			cout << setw(12) << left << entry->t_ref;
+			int pte = pgtable.find(frame[i]);
+			cout << setw(12) << left << ((pgtable.flags(pte) & MM::VP_REFED) != 0);
+			cout << setw(12) << left << ((pgtable.flags(pte) & MM::VP_PRESENT) != 0);
+			cout << setw(12) << left << frame_t_in[i];
+			cout << setw(12) << left << frame_t_ref[i];
 			cout << setw(12) << left << frame[i];
-			cout << setw(12) << left << entry->addr << endl;
+			cout << setw(12) << left << pgtable.addr(pte) << endl;
 		}
 		else {
 			cout << setw(12 * 6) << left << "empty frame" << endl;
@@ -542,13 +1057,13 @@ vector<vector<string>> VirtMemoryModel::mm_expose(int pid, string name) {
 		state.push_back(to_string(pid));
 		state.push_back(name);
 		if (frame[i] != -1) {
-			auto entry = pgtable[frame[i]];
-			state.push_back(to_string(entry->refed));
-			state.push_back(to_string(entry->present));
-			state.push_back(to_string(entry->t_in));
-			state.push_back(to_string(entry->t_ref));
+			int pte = pgtable.find(frame[i]);
+			state.push_back(to_string((pgtable.flags(pte) & MM::VP_REFED) != 0));
+			state.push_back(to_string((pgtable.flags(pte) & MM::VP_PRESENT) != 0));
+			state.push_back(to_string(frame_t_in[i]));
+			state.push_back(to_string(frame_t_ref[i]));
 			state.push_back(to_string(frame[i]));
-			state.push_back(to_string(entry->addr));
+			state.push_back(to_string(pgtable.addr(pte)));
 		}
 		else {
 			state.push_back(string("empty frame"));
@@ -558,10 +1073,24 @@ vector<vector<string>> VirtMemoryModel::mm_expose(int pid, string name) {
 	return res;
 }
 
+// the policy state belongs to the kernel thread, the change
+// is applied there on the next reference or fault
 void VirtMemoryModel::chalg(MM::Algorithm newalg) {
-	this->algo = newalg;
+	algo_req.store(newalg, memory_order_release);
+}
+
+void VirtMemoryModel::policy_sync() {
+	if (algo_req.load(memory_order_relaxed) == MM::Algorithm::NONE) return;
+	MM::Algorithm a = algo_req.exchange(MM::Algorithm::NONE, memory_order_acquire);
+	if (a == MM::Algorithm::NONE) return;
+	algo = a;
+	policy_reset();
+}
+
+double VirtMemoryModel::tlb_rate() {
+	return tlb_hits + tlb_misses ? 100.0 * tlb_hits / (tlb_hits + tlb_misses) : 0;
 }
 
 double VirtMemoryModel::pf_rate() {
 	return acc_cnt ? (repl_cnt * 100) / acc_cnt : 0;
-}
\ No newline at end of file
+}
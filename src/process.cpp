@@ -1020,6 +1020,7 @@ void Scheduler::read_table() {
 			cout << setw(12) << left << st->mem->get_nmapped();
 			cout << setw(12) << left << st->mem->get_nblocks();
 			cout << setw(12) << left << setprecision(2) << fixed << st->mem->pf_rate();
+			cout << setw(12) << left << setprecision(2) << fixed << st->mem->tlb_rate();
 			cout << endl;
 		}
 	}
@@ -1048,6 +1049,8 @@ vector<vector<string>> Scheduler::expose() {
 			state.push_back(to_string(v->est));
 			string pfr = to_string(v->mem->pf_rate());
 			state.push_back(pfr.substr(0, pfr.find(".") + 3));
+			string tlbr = to_string(v->mem->tlb_rate());
+			state.push_back(tlbr.substr(0, tlbr.find(".") + 3));
 			res.push_back(state);
 		}
 	}
@@ -1103,6 +1106,9 @@ pair<string, string> Scheduler::alg() {
 	else pa = "Unknown";
 	if (ralgo == MM::Algorithm::FIFO) ma = "FIFO";
 	else if (ralgo == MM::Algorithm::LRU) ma = "LRU";
+	else if (ralgo == MM::Algorithm::CLOCK) ma = "CLOCK";
+	else if (ralgo == MM::Algorithm::TWO_Q) ma = "2Q";
+	else if (ralgo == MM::Algorithm::ARC) ma = "ARC";
 	else ma = "Unknown";
 	return { pa, ma };
 }
@@ -1297,8 +1303,8 @@ string Process::seek_names(int id) {
 int Process::generate_random_pg() {
 	uniform_int_distribution<int> meta(0, 9);
 	uniform_int_distribution<int> dist_local(last_page - 1, 
-		min(last_page + 1, static_cast<int>(MM::VIRT_MEM_SIZE / MM::PAGE_SIZE - 1)));
-	uniform_int_distribution<int> dist_far(1, MM::VIRT_MEM_SIZE / MM::PAGE_SIZE - 1);
+		min(last_page + 1, static_cast<int>(MM::PROC_SPAN / MM::PAGE_SIZE - 1)));
+	uniform_int_distribution<int> dist_far(1, MM::PROC_SPAN / MM::PAGE_SIZE - 1);
 	int page = -1;
 	int roll = meta(rd_s);
 	if (roll < 5) { // 50%
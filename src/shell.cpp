@@ -168,6 +168,9 @@ void Shell_CLI::show() {
 			else if (cmd == "mem") {
 				this->mem();
 			}
+			else if (cmd == "sync") {
+				kernel->fs->sync();
+			}
 			else if (cmd == "set") {
 				if (pos == string::npos) {
 					cout << cmd << ": not enough argument." << endl;
@@ -255,6 +258,64 @@ void Shell_CLI::show() {
 				cout << "System Throughtput="
 					<< setprecision(2) << fixed << kernel->sch->cpu_rate()
 					<< "/60Ticks" << endl;
+				cout << "Disk Block Size=" << FS::geo.blk_size
+					<< " Data Blocks=" << FS::geo.ndatablks
+					<< " Inodes=" << FS::geo.ninodes
+					<< " (" << static_cast<uint64_t>(FS::geo.nblks) * FS::geo.blk_size
+					<< " Bytes)" << endl;
+				MM::SwapStat ss = kernel->pg->swap_stat();
+				cout << "Swap Pages Out=" << ss.pages_out
+					<< " In=" << ss.pages_in
+					<< " Writes=" << ss.writes
+					<< " Reads=" << ss.reads
+					<< " Cache Hits=" << ss.cache_hits
+					<< " Readaround=" << ss.readaround << endl;
+				if (ss.z_limit)
+					cout << "Zswap Pool=" << ss.z_used << "/" << ss.z_limit
+						<< " Bytes Stored=" << ss.z_stored
+						<< " Same-filled=" << ss.z_same
+						<< " Rejected=" << ss.z_rejected
+						<< " Spilled=" << ss.z_spilled
+						<< " Ratio=" << (ss.z_packed ? static_cast<double>(ss.z_raw) / ss.z_packed : 0)
+						<< " Hit Rate=" << (ss.pages_in ? 100.0 * ss.z_hits / ss.pages_in : 0) << "%" << endl;
+				FS::DevStat ds = kernel->fs->dev_stat();
+				cout << "Disk Reads=" << ds.reads
+					<< " (" << ds.bytes_read << " Bytes)" << endl;
+				cout << "Disk Writes=" << ds.writes
+					<< " (" << ds.bytes_written << " Bytes)" << endl;
+				FS::CacheStat cs = kernel->fs->cache_stat();
+				cout << "Buffer Cache Hits=" << cs.hits
+					<< " Misses=" << cs.misses
+					<< " Writebacks=" << cs.writebacks << endl;
+				cs = kernel->fs->icache_stat();
+				cout << "Inode Cache Hits=" << cs.hits
+					<< " Misses=" << cs.misses
+					<< " Block Writebacks=" << cs.writebacks << endl;
+				FS::LookupStat ls = kernel->fs->dcache_stat();
+				cout << "Dentry Cache Hits=" << ls.hits
+					<< " Negative=" << ls.negative_hits
+					<< " Misses=" << ls.misses << endl;
+				FS::JournalStat js = kernel->fs->journal_stat();
+				cout << "Journal Commits=" << js.commits
+					<< " Logged Blocks=" << js.logged
+					<< " Revokes=" << js.revokes
+					<< " Checkpoints=" << js.checkpoints
+					<< " Replayed=" << js.replayed << endl;
+				FS::ReadaheadStat rs = kernel->fs->ra_stat();
+				cout << "Readahead Prefetched=" << rs.prefetched
+					<< " Hits=" << rs.hits
+					<< " Wasted=" << rs.waste << endl;
+				FS::AioStat as = kernel->fs->aio_stat();
+				cout << "Async I/O Submitted=" << as.submitted
+					<< " Completed=" << as.completed
+					<< " Depth=" << as.depth
+					<< " Max Depth=" << as.max_depth << endl;
+				cout << "Async I/O Latency Avg="
+					<< (as.completed ? as.lat_us / as.completed : 0) << "us"
+					<< " Max=" << as.max_lat_us << "us"
+					<< " Avg Ticks=" << setprecision(2) << fixed
+					<< (as.reaped ? static_cast<double>(as.lat_ticks) / as.reaped : 0.0)
+					<< endl;
 			}
 			else if (cmd == "chmod") {
 				if (pos == string::npos) {
@@ -273,6 +334,15 @@ void Shell_CLI::show() {
 				trim(args);
 				kernel->fs->chmod(path, stoi(mode));
 			}
+			else if (cmd == "dirtyage") {
+				if (pos == string::npos) {
+					cout << cmd << ": not enough argument." << endl;
+					break;
+				}
+				string ticks = line.substr(pos + 1);
+				trim(ticks);
+				kernel->fs->set_dirty_age(stoi(ticks));
+			}
 			else if (cmd == "mount") {
 				if (pos == string::npos) {
 					cout << cmd << ": not enough argument." << endl;
@@ -390,10 +460,9 @@ void Shell_CLI::ls() {
 }
 void Shell_CLI::ls(string path, int r, int a, int l) {
 	struct FS::Inode* inode = new struct FS::Inode;
-	struct FS::Dir* dir = new struct FS::Dir[8];
-	int idx = kernel->fs->walk(path, inode, dir);
+	vector<struct FS::Dir> dir = kernel->fs->list_dir(path);
 	int cnt = 1;
-	for (int i = 0; i < 8; i++) {
+	for (size_t i = 0; i < dir.size(); i++) {
 		if (dir[i].type == FS::File_t::None) continue;
 		string name = dir[i].entry_name;
 		if (r) name = path[path.size() - 1] == '/' ?
@@ -442,7 +511,7 @@ void Shell_CLI::ls(string path, int r, int a, int l) {
 		  + Term::color(Term::fg::reset)
 		  + Term::color(Term::style::reset);
 	if (r) {
-		for (int i = 0; i < 8; i++) {
+		for (size_t i = 0; i < dir.size(); i++) {
 			if (dir[i].type == FS::File_t::None
 				|| dir[i].type == FS::File_t::File
 				|| strcmp(dir[i].entry_name, ".") == 0
@@ -454,7 +523,6 @@ void Shell_CLI::ls(string path, int r, int a, int l) {
 		}
 	}
 	delete inode;
-	delete[] dir;
 }
 
 void Shell_CLI::touch(string name) {
@@ -470,7 +538,22 @@ void Shell_CLI::touch(string name) {
 	}
 	kernel->fs->create(path, fname, FS::File_t::File);
 }
+// mkswap name [slots]
 void Shell_CLI::mkswap(string name) {
+	int nslots = FS::MAX_N_BLKS;
+	auto sp = name.find(" ");
+	if (sp != string::npos) {
+		string arg = name.substr(sp + 1);
+		trim(arg);
+		try {
+			nslots = stoi(arg);
+		}
+		catch (...) {
+			cout << "Invalid slot count " << arg << endl;
+			return;
+		}
+		name = name.substr(0, sp);
+	}
 	auto pos = name.rfind("/");
 	string path, fname;
 	if (pos == string::npos) {
@@ -483,8 +566,8 @@ void Shell_CLI::mkswap(string name) {
 	}
 	trim(path);
 	trim(fname);
-	kernel->pg->new_swap(path + "/" + name);
-	kernel->fs->create_swapspace(path + "/", name);
+	if (nslots <= 0 || !kernel->mkswap(path, fname, nslots))
+		cout << name << ": cannot create swap." << endl;
 }
 void Shell_CLI::mkdir(string name) {
 	kernel->fs->create(pwd_str, name, FS::File_t::Dir);
@@ -497,17 +580,20 @@ void Shell_CLI::cd(string path) {
 	pwd_str = kernel->fs->get_pwd();
 }
 void Shell_CLI::cat(string name) {
-	char* buf = new char[FS::MAX_N_BLKS * FS::BLK_SIZE];
-	memset(buf, 0, FS::MAX_N_BLKS * FS::BLK_SIZE);
+	cout << read_file(name) << endl;
+}
+string Shell_CLI::read_file(string name) {
+	int64_t size = kernel->fs->file_size(name);
+	char* buf = new char[size > 0 ? size + 1 : 1];
+	buf[0] = 0;
 	kernel->fs->read(name, buf, 0, -1);
 	string content(buf);
-	cout << content << endl;
 	delete[] buf;
+	return content;
 }
 void Shell_CLI::edit(Term::Terminal term, string name) {
-	std::function<void(std::string, char*)> ofn =
-		bind(&Filesystem::read, kernel->fs, placeholders::_1, placeholders::_2,
-			0, -1);
+	std::function<std::string(std::string)> ofn =
+		bind(&Shell_CLI::read_file, this, placeholders::_1);
 	std::function<void(std::string, char*, size_t)> sfn =
 		bind(&Filesystem::write, kernel->fs, placeholders::_1, placeholders::_2,
 			0, placeholders::_3);
@@ -526,8 +612,9 @@ void Shell_CLI::ps() {
 	cout << setw(12) << left << "eta";
 	cout << setw(12) << left << "nmapped";
 	cout << setw(12) << left << "nblocks";
-	cout << setw(12) << left << "pf rate(%)" << endl;
-	cout << setfill('_') << setw(12 * 12) << "_" << endl;
+	cout << setw(12) << left << "pf rate(%)";
+	cout << setw(12) << left << "tlb hit(%)" << endl;
+	cout << setfill('_') << setw(12 * 13) << "_" << endl;
 	cout << setfill(' ') << Term::color(Term::fg::reset) + Term::color(Term::style::reset);
 	kernel->sch->read_table();
 }
@@ -604,6 +691,15 @@ void Shell_CLI::chalg(string p1, string p2) {
 	else if (p2 == "LRU") {
 		ma = MM::Algorithm::LRU;
 	}
+	else if (p2 == "CLOCK") {
+		ma = MM::Algorithm::CLOCK;
+	}
+	else if (p2 == "2Q") {
+		ma = MM::Algorithm::TWO_Q;
+	}
+	else if (p2 == "ARC") {
+		ma = MM::Algorithm::ARC;
+	}
 	else if (p2 == "") {
 		ma = MM::Algorithm::NONE;
 	}